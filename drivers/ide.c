@@ -42,6 +42,7 @@
 #include <simplix/list.h>
 #include <simplix/proto.h>
 #include <simplix/types.h>
+#include <simplix/wait.h>
 
 /* We support up to 2 IDE controllers in Simplix. */
 #define NR_IDE_CONTROLLERS 2
@@ -153,10 +154,11 @@ struct ide_controller {
        protects the controller while it's being used by another task. */
     struct kmutex *mutex;
 
-    /* When issuing a request to the IDE controller, a task decrements
-       the value of this semaphore (DOWN). The IRQ handler increments it
-       when the I/O operation has completed. */
-    struct ksema *io_sema;
+    /* After issuing a request to the IDE controller, a task waits on this
+       queue until the IRQ handler reports that the I/O operation has
+       completed, or until the request times out. */
+    struct wait_queue io_wait;
+    bool_t io_done;
 };
 
 /* Simplix supports up to 2 IDE controllers addressable via their standard
@@ -387,6 +389,14 @@ static struct ide_device *get_ide_device(unsigned int minor)
     return device;
 }
 
+/*
+ * Returns whether the specified controller completed the current command.
+ */
+static bool_t io_completed(void *data)
+{
+    return ((struct ide_controller *) data)->io_done;
+}
+
 /*
  * Generic read/write function.
  */
@@ -444,6 +454,9 @@ static unsigned int ide_read_write_blocks(unsigned int minor, offset_t block,
 
     cmd = type == IO_READ ? ATA_READ_BLOCK : ATA_WRITE_BLOCK;
 
+    /* From now on, the IRQ handler reports the completion of this command. */
+    controller->io_done = FALSE;
+
     /* See ATA/ATAPI-4 spec, section 8.27.4 */
     outb(iobase + ATA_NSECTOR, nblocks);
     outb(iobase + ATA_SECTOR, sc);
@@ -474,11 +487,18 @@ static unsigned int ide_read_write_blocks(unsigned int minor, offset_t block,
             outw(iobase + ATA_DATA, *buf++);
     }
 
-    /* Go to sleep until the IRQ handler wakes us up. Note: on Bochs, the IRQ
-       is raised before we even reach this line! This is OK, and in that case,
-       this line will not make us go to sleep (the semaphore will have been
-       incremented by the IRQ handler prior to reaching this line) */
-    ksema_down(controller->io_sema);
+    /* Go to sleep until the IRQ handler wakes us up, or until the command
+       times out. Note: on Bochs, the IRQ is raised before we even reach this
+       line! This is OK, and in that case, this line will not make us go to
+       sleep (io_done will have been set by the IRQ handler prior to reaching
+       this line) The device never raising its IRQ is handled by resetting
+       the controller, so that the command does not complete behind our back. */
+    if (wait_event(&controller->io_wait, &io_completed, controller, FALSE,
+            ATA_TIMEOUT / 1000 * HZ / 1000) != S_OK) {
+        reset_controller(controller);
+        kmutex_unlock(controller->mutex);
+        return 0;
+    }
 
     /* Either the device completed the operation very quickly,
        or we went to sleep and just got woken up by the IRQ handler. */
@@ -524,7 +544,8 @@ static void handle_ide_controller_interrupt(uint32_t esp,
     struct ide_controller *controller)
 {
     /* This wakes up the task waiting for the I/O operation to complete. */
-    ksema_up(controller->io_sema);
+    controller->io_done = TRUE;
+    wait_queue_wake(&controller->io_wait);
 }
 
 static void handle_primary_ide_controller_interrupt(uint32_t esp)
@@ -557,7 +578,7 @@ void init_ide_devices(void)
         /* Initialize the controller structure. */
         controller = &controllers[i];
         controller->mutex = kmutex_init();
-        controller->io_sema = ksema_init(0);
+        init_wait_queue(&controller->io_wait);
 
         /* Detect and identify IDE devices attached to this controller. */
         for (j = 0; j < NR_DEVICES_PER_CONTROLLER; j++) {
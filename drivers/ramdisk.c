@@ -45,12 +45,19 @@ struct ramdisk {
     /* The capacity of this RAM disk instance, in number of blocks. */
     unsigned int nblocks;
 
+    /* Number of read/write operations in progress on this RAM disk. Its
+       memory cannot be moved while this is not 0. */
+    unsigned int busy;
+
     /* Doubly linked list pointers. */
     struct ramdisk *prev, *next;
 };
 
 struct ramdisk *ramdisk_list_head = NULL;
 
+/* Slab of RAM disk instances. */
+static struct kmem_slab *ramdisk_slab;
+
 /*
  * Returns the RAM disk instance associated with the specified minor number.
  */
@@ -83,10 +90,19 @@ static unsigned int ramdisk_read_write_blocks(unsigned int minor,
     struct ramdisk *rd;
     addr_t addr;
     size_t size;
+    unsigned long eflags;
+
+    disable_hwint(eflags);
 
     rd = get_ramdisk_instance(minor);
-    if (!rd || block + nblocks > rd->nblocks)
+    if (!rd || block + nblocks > rd->nblocks) {
+        restore_hwint(eflags);
         return 0;
+    }
+
+    /* Pin the RAM disk memory while we are copying data. */
+    rd->busy++;
+    restore_hwint(eflags);
 
     addr = rd->addr + block * BLOCK_SIZE;
     size = nblocks * BLOCK_SIZE;
@@ -97,9 +113,28 @@ static unsigned int ramdisk_read_write_blocks(unsigned int minor,
         memcpy(buffer, (void *) addr, size);
     }
 
+    disable_hwint(eflags);
+    rd->busy--;
+    restore_hwint(eflags);
+
     return nblocks;
 }
 
+/*
+ * Mover of the physical memory block backing a RAM disk (see
+ * set_physmem_block_mover) This is called with hardware interrupts disabled.
+ */
+static bool_t move_ramdisk(void *owner, addr_t new_addr)
+{
+    struct ramdisk *rd = owner;
+
+    if (rd->busy)
+        return FALSE;
+
+    rd->addr = new_addr;
+    return TRUE;
+}
+
 /*
  * Read the specified block from the specified RAM disk, and copy its content to
  * the destination buffer. The work is delegated to ramdisk_read_write_blocks.
@@ -125,6 +160,10 @@ static unsigned int ramdisk_write_blocks(unsigned int minor, offset_t block,
  */
 void init_ramdisk_driver(void)
 {
+    ramdisk_slab = kmem_slab_create("ramdisk", sizeof(struct ramdisk), NULL);
+    if (!ramdisk_slab)
+        panic("Could not create the slab of RAM disks");
+
     register_blkdev_class(BLKDEV_RAM_DISK_MAJOR, "RAM Disk Driver",
         &ramdisk_read_blocks, &ramdisk_write_blocks);
 }
@@ -142,7 +181,7 @@ ret_t create_ramdisk(size_t len, unsigned int *minor)
     if (!len)
         return -E_INVALIDARG;
 
-    rd = __kmalloc(sizeof(struct ramdisk));
+    rd = kmem_slab_alloc(ramdisk_slab);
     if (!rd)
         return -E_NOMEM;
 
@@ -153,6 +192,10 @@ ret_t create_ramdisk(size_t len, unsigned int *minor)
     }
 
     rd->nblocks = (pages << PAGE_BIT_SHIFT) / BLOCK_SIZE;
+    rd->busy = 0;
+
+    /* The RAM disk memory can be moved around to compact physical memory. */
+    set_physmem_block_mover(rd->addr, &move_ramdisk, rd);
 
     disable_hwint(eflags);
     rd->minor = n++;
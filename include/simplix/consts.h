@@ -51,6 +51,9 @@
 /* Device busy. */
 #define E_BUSY 5
 
+/* Operation timed out. */
+#define E_TIMEDOUT 6
+
 
 /*===========================================================================*
  * Constants related to the interrupt controller.                            *
@@ -142,13 +145,14 @@
  * See Intel Developer's Manual Volume 3 - table 3-1                         *
  *===========================================================================*/
 
-#define GDT_CS_TYPE  0x9a /* present, system, DPL-0, execute/read     */
-#define GDT_DS_TYPE  0x92 /* present, system, DPL-0, read/write       */
-#define GDT_TSS_TYPE 0x89 /* present, system, DPL-0, 32-bit TSS       */
-#define GDT_LDT_TYPE 0x82 /* present, system, DPL-0, LDT              */
+#define GDT_CS_TYPE    0x9a /* present, system, DPL-0, execute/read     */
+#define GDT_DS_TYPE    0x92 /* present, system, DPL-0, read/write       */
+#define GDT_TSS_TYPE   0x89 /* present, system, DPL-0, 32-bit TSS       */
+#define GDT_LDT_TYPE   0x82 /* present, system, DPL-0, LDT              */
 
-#define LDT_CS_TYPE  0xfa /* present, non-system, DPL-3, execute/read */
-#define LDT_DS_TYPE  0xf2 /* present, non-system, DPL-3, read/write   */
+#define LDT_CS_TYPE    0xfa /* present, non-system, DPL-3, execute/read */
+#define LDT_DS_TYPE    0xf2 /* present, non-system, DPL-3, read/write   */
+#define LDT_KINFO_TYPE 0xf0 /* present, non-system, DPL-3, read-only    */
 
 
 /*===========================================================================*
@@ -170,13 +174,15 @@
  * Local Descriptor Table (LDT)                                              *
  *===========================================================================*/
 
-#define NR_LDT_ENTRIES 2
+#define NR_LDT_ENTRIES 3
 
-#define LDT_CS_INDEX 0 /* code segment */
-#define LDT_DS_INDEX 1 /* data segment */
+#define LDT_CS_INDEX    0 /* code segment                          */
+#define LDT_DS_INDEX    1 /* data segment                          */
+#define LDT_KINFO_INDEX 2 /* kernel information segment (kinfo.h)  */
 
-#define LDT_CS SEG_REG_VAL(USER_PRIVILEGE_LEVEL, 1, LDT_CS_INDEX)
-#define LDT_DS SEG_REG_VAL(USER_PRIVILEGE_LEVEL, 1, LDT_DS_INDEX)
+#define LDT_CS    SEG_REG_VAL(USER_PRIVILEGE_LEVEL, 1, LDT_CS_INDEX)
+#define LDT_DS    SEG_REG_VAL(USER_PRIVILEGE_LEVEL, 1, LDT_DS_INDEX)
+#define LDT_KINFO SEG_REG_VAL(USER_PRIVILEGE_LEVEL, 1, LDT_KINFO_INDEX)
 
 
 /*===========================================================================*
@@ -193,6 +199,19 @@
 #define PAGE_ALIGN_INF(addr) ((unsigned) (addr) & PAGE_MASK)
 #define PAGE_ALIGN_SUP(addr) (((unsigned) (addr) + (PAGE_SIZE - 1)) & PAGE_MASK)
 
+/* If non zero, growing the data segment of a task (see sys_brk) reserves
+   twice the amount of physical memory needed, so that a data segment grown
+   in small increments only gets copied a logarithmic number of times. */
+#define BRK_GEOMETRIC_RESERVE 1
+
+/* Interval, in milliseconds, at which the compaction thread checks how
+   fragmented physical memory is (see compaction_task in physmem.c) */
+#define COMPACTION_INTERVAL 5000
+
+/* The compaction thread compacts physical memory when the largest hole is
+   smaller than this percentage of the free memory. */
+#define COMPACTION_THRESHOLD 50
+
 
 /*===========================================================================*
  * Timer and time management.                                                *
@@ -204,6 +223,12 @@
 /* Scheduler frequency, expressed in number of ticks. */
 #define SCHED_TICKS 10
 
+/* When DYNAMIC_TICKS is 1, the timer stops interrupting the CPU at every tick
+   while the idle task has nothing to do, and only fires when the next kernel
+   timer expires (see idle_halt in timer.c) Set it to 0 to keep the timer
+   periodic. */
+#define DYNAMIC_TICKS 1
+
 
 /*===========================================================================*
  * Constants related to tasks and task management.                           *
@@ -233,18 +258,44 @@
 #define TASK_UNINTERRUPTIBLE 2
 #define TASK_DEAD            3
 
-/* Initial time slice expressed in number of timer ticks. */
-#define INITIAL_TIMESLICE (10 * SCHED_TICKS)
-
-/* Once the time slice of all runnable tasks (not including the idle task)
-   has been exhausted, the time slice of all tasks is incremented by the
-   following value. */
-#define TIMESLICE_INCREMENT (3 * SCHED_TICKS)
-
-/* Maximum time slice a task may accrue if it spends all of its time waiting.
-   This is to avoid having an IO-bound task accrue a huge time slice before
-   suddenly becoming CPU bound. */
-#define MAX_TIMESLICE (15 * SCHED_TICKS)
+/* Range of task nice values. The lower the nice value, the larger the share
+   of the CPU a task gets relative to other tasks. */
+#define NICE_MIN -20
+#define NICE_MAX  19
+
+/* Scheduling policies (see set_task_scheduler) Runnable real-time tasks
+   (SCHED_FIFO and SCHED_RR) always get the CPU before normal tasks. A
+   SCHED_FIFO task runs until it sleeps or a real-time task with a higher
+   priority wakes up. SCHED_RR tasks at the same priority take turns. */
+#define SCHED_NORMAL 0
+#define SCHED_FIFO   1
+#define SCHED_RR     2
+
+/* Highest real-time priority. Real-time priorities start at 0. */
+#define RT_PRIO_MAX 31
+
+/* Time slice of SCHED_RR tasks, expressed in number of timer ticks. */
+#define RR_TIMESLICE (10 * SCHED_TICKS)
+
+/* Real-time tasks may run at most RT_RUNTIME ticks out of every RT_PERIOD
+   ticks while normal tasks are waiting for the CPU, so a runaway real-time
+   task cannot lock up the system. */
+#define RT_PERIOD  HZ
+#define RT_RUNTIME (RT_PERIOD * 95 / 100)
+
+/* When WAKEUP_PREEMPTION is 1, a task that wakes up having run sufficiently
+   less than the current task preempts it when the interrupt or system call that
+   woke it up returns, rather than at the next scheduler tick. Set it to 0 to
+   compare wake-up latencies (see sched_stats) */
+#define WAKEUP_PREEMPTION 1
+
+/* Benchmark started at boot time, along with the test tasks (see main.c)
+   Only one can be selected, since they would perturb each other. Set
+   BOOT_BENCHMARK to BENCHMARK_NONE to boot without running any. */
+#define BENCHMARK_NONE       0
+#define BENCHMARK_FORK_STORM 1
+#define BENCHMARK_PING_PONG  2
+#define BOOT_BENCHMARK       BENCHMARK_NONE
 
 
 /*===========================================================================*
@@ -255,7 +306,10 @@
 #define SYSCALL_INT_NUM 0x80
 
 /* Number of system calls. */
-#define NR_SYSCALLS 9
+#define NR_SYSCALLS 14
+
+/* Maximum number of system calls submitted at once (see sys_syscall_batch) */
+#define SYSCALL_BATCH_MAX 256
 
 /* List of system calls (value of EAX register) */
 #define SYSCALL_EXIT        0
@@ -267,6 +321,11 @@
 #define SYSCALL_STIME       6
 #define SYSCALL_SLEEP       7
 #define SYSCALL_BRK         8
+#define SYSCALL_IDLE        9
+#define SYSCALL_NICE        10
+#define SYSCALL_SETPRIORITY 11
+#define SYSCALL_SCHED_SETSCHEDULER 12
+#define SYSCALL_BATCH       13
 
 
 /*===========================================================================*
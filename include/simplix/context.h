@@ -68,6 +68,12 @@ struct task_cpu_context {
 
 #endif /* ASM_SOURCE */
 
+/* Offset of the cs member of struct task_cpu_context, and offset of the ctx
+   member of struct task_struct (see task.h) These are used by assembly code,
+   and checked at compile time (see sched.c) */
+#define CTX_CS   60
+#define TASK_CTX 0
+
 /* Saves the current CPU context in the stack. */
 
 #define save_context \
@@ -90,4 +96,20 @@ struct task_cpu_context {
     popa;               \
     addl $4, %esp
 
+/* Calls update_tss_ldt with the context saved on top of the stack (see
+   sched.c) if we are about to return to user space, unless the LDT and the
+   TSS have already been set up for the current task. Clobbers EAX, which is
+   fine since the context is restored right after this. */
+
+#define update_tss_ldt_if_needed  \
+    testb $3, CTX_CS(%esp);       \
+    jz 9f;                        \
+    mov current, %eax;            \
+    cmp ldt_owner, %eax;          \
+    je 9f;                        \
+    push %esp;                    \
+    call update_tss_ldt;          \
+    add $4, %esp;                 \
+9:
+
 #endif /* _SIMPLIX_CONTEXT_H_ */
@@ -27,7 +27,9 @@
 #ifndef _SIMPLIX_GLOBALS_H_
 #define _SIMPLIX_GLOBALS_H_
 
+#include <simplix/kinfo.h>
 #include <simplix/segment.h>
+#include <simplix/stats.h>
 #include <simplix/task.h>
 #include <simplix/tss.h>
 #include <simplix/types.h>
@@ -35,6 +37,9 @@
 /* Size of the physical memory. Storage for this is created in physmem.c */
 extern size_t physmem_size;
 
+/* Physical memory statistics. Storage for this is created in physmem.c */
+extern struct physmem_stats physmem_stats;
+
 /* Our low level system call handler (see in syscall.S) */
 extern addr_t syscall_handler;
 
@@ -47,6 +52,21 @@ extern struct task_struct *current;
 /* The idle task. Storage for this is created in sched.c */
 extern struct task_struct *idle_task;
 
+/* Set when a task that deserves the CPU more than the current task was woken
+   up. Storage for this is created in sched.c */
+extern bool_t need_resched;
+
+/* The task whose LDT and kernel-space stack are currently set up in the GDT,
+   LDTR and TSS. Storage for this is created in sched.c */
+extern struct task_struct *ldt_owner;
+
+/* Kernel information segment, readable by user tasks. Storage for this is
+   created in sched.c */
+extern struct kinfo kinfo;
+
+/* Scheduler statistics. Storage for this is created in sched.c */
+extern struct sched_stats sched_stats;
+
 /* The Global Descriptor Table (GDT) used by Simplix (see gdt.c) */
 extern struct segment_descriptor gdt[];
 
@@ -56,6 +76,14 @@ extern struct tss_struct tss;
 /* Low level system call handler. Storage for this is created in syscall.S */
 extern addr_t syscall_handler;
 
+/* Set if system calls are made with the SYSENTER instruction rather than with
+   an interrupt. Storage for this is created in sys.c */
+extern bool_t sysenter_enabled;
+
+/* Set while printk must not output anything, e.g. while a benchmark is
+   running. Storage for this is created in main.c */
+extern bool_t printk_muted;
+
 /* Time related globals (see timer.c) */
 extern unsigned long ticks;
 extern time_t realtime;
@@ -0,0 +1,76 @@
+/*===========================================================================
+ *
+ * kinfo.h
+ *
+ * Copyright (C) 2007 - Julien Lecomte
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ *===========================================================================
+ *
+ * Kernel information segment. The kernel keeps a few values that user tasks
+ * often need up to date in a small structure, which every user task can read
+ * (but not write) through a read-only segment of its LDT, addressed with the
+ * GS register. This lets time(), getpid() and getppid() (see syscalls.h) get
+ * their result without making a system call.
+ *
+ * The values describing the current task are rewritten at every task switch,
+ * so a user task always sees its own. The kernel increments the sequence
+ * counter before and after every update, so a reader that got preempted in
+ * the middle of reading the structure notices it, and reads it again.
+ *
+ *===========================================================================*/
+
+#ifndef _SIMPLIX_KINFO_H_
+#define _SIMPLIX_KINFO_H_
+
+#include <simplix/types.h>
+
+struct kinfo {
+
+    /* Sequence counter, odd while an update is in progress. */
+    unsigned long seq;
+
+    /* Number of seconds since the Epoch (see realtime) */
+    time_t realtime;
+
+    /* Pid of the current task, and pid of its parent task. */
+    pid_t pid;
+    pid_t ppid;
+};
+
+/* Bracket every update of the kernel information segment. Hardware interrupts
+   must be disabled. */
+#define kinfo_update_begin() do {           \
+    kinfo.seq++;                            \
+    asm volatile("" ::: "memory");          \
+} while (0)
+
+#define kinfo_update_end() do {             \
+    asm volatile("" ::: "memory");          \
+    kinfo.seq++;                            \
+} while (0)
+
+/* Reads the specified member of the kernel information segment from user
+   space. The reads cannot be reordered with respect to each other. */
+#define kinfo_read(member) ({                               \
+    unsigned long __val;                                    \
+    asm volatile("movl %%gs:%c1, %0"                        \
+        : "=r" (__val)                                      \
+        : "i" (__builtin_offsetof(struct kinfo, member)));  \
+    __val;                                                  \
+})
+
+#endif /* _SIMPLIX_KINFO_H_ */
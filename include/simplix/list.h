@@ -70,10 +70,12 @@ if ((item)->next == (item)) {                          \
     (item)->prev->next = (item)->next;                 \
 }
 
-#define list_pop_head_named(list_head, prev, next) ({    \
-    typeof(list_head) __ret = (list_head);               \
-    list_remove_named(list_head, list_head, prev, next); \
-    __ret;                                               \
+/* Note: the item must not be list_head itself, since list_remove_named
+   modifies list_head before it is done with the item. */
+#define list_pop_head_named(list_head, prev, next) ({ \
+    typeof(list_head) __ret = (list_head);            \
+    list_remove_named(list_head, __ret, prev, next);  \
+    __ret;                                            \
 })
 
 #define list_replace_named(list_head, old, new, prev, next) \
@@ -29,11 +29,59 @@
 
 #include <simplix/consts.h>
 
-/* Miscellaneous inline assembly macros. */
+/* Miscellaneous inline assembly macros. Some kernel modules can also be built
+   into regular programs running on the build host, with HOSTED defined (see
+   tools/) In that case, there are no interrupts to disable, and halting the
+   CPU would make the program crash with a less obvious error than a trap. */
 #define idle()  asm("1: jmp 1b")
+#ifndef HOSTED
 #define hlt()   asm("hlt")
 #define cli()   asm("cli")
 #define sti()   asm("sti")
+#else
+#define hlt()   __builtin_trap()
+#define cli()   ((void) 0)
+#define sti()   ((void) 0)
+#endif /* HOSTED */
+
+/* Index of the least (bsf) or most (bsr) significant bit set in a non-zero
+   value. The result is undefined if the value is 0. */
+#define bsf(n) ({                                                   \
+    unsigned long __ret;                                            \
+    asm("bsf %1, %0" : "=r" (__ret) : "rm" ((unsigned long) (n)));  \
+    __ret;                                                          \
+})
+
+#define bsr(n) ({                                                   \
+    unsigned long __ret;                                            \
+    asm("bsr %1, %0" : "=r" (__ret) : "rm" ((unsigned long) (n)));  \
+    __ret;                                                          \
+})
+
+/* Value of the time-stamp counter, which counts CPU cycles. */
+#define rdtsc() ({                                  \
+    unsigned long long __ret;                       \
+    asm volatile("rdtsc" : "=A" (__ret));           \
+    __ret;                                          \
+})
+
+/* Whether the processor supports the CPUID instruction, which is the case if
+   the ID flag (bit 21) of the EFLAGS register can be toggled. */
+#define has_cpuid() ({                                              \
+    unsigned long __eflags, __toggled;                              \
+    asm("pushf; pop %0; mov %0, %1; xor %2, %1; push %1; popf;"     \
+        "pushf; pop %1; push %0; popf"                              \
+        : "=&r" (__eflags), "=&r" (__toggled) : "i" (1 << 21));    \
+    ((__eflags ^ __toggled) & (1 << 21)) != 0;                      \
+})
+
+/* Executes the CPUID instruction for the specified leaf. */
+#define cpuid(leaf, a, b, c, d) \
+    asm("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d) : "a" (leaf))
+
+/* Writes the specified 32-bit value to a model-specific register. */
+#define wrmsr(msr, val) \
+    asm volatile("wrmsr" :: "c" (msr), "a" (val), "d" (0))
 
 /*
  * The macro disable_hwint disables all hardware interrupts. The macro
@@ -76,8 +124,13 @@
  * re-enable hardware interrupts.
  */
 
+#ifndef HOSTED
 #define disable_hwint(eflags) asm("pushf; pop %0; cli;" : "=g" ((eflags)))
 #define restore_hwint(eflags) asm("push %0; popf;" :: "g" ((eflags)))
+#else
+#define disable_hwint(eflags) ((eflags) = 0)
+#define restore_hwint(eflags) ((void) (eflags))
+#endif /* HOSTED */
 
 /* Usually, when handling a timeout, you would write something like:
 
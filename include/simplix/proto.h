@@ -35,6 +35,8 @@
  * blockdev.c                                                                *
  *===========================================================================*/
 
+void init_blkdev(void);
+
 ret_t register_blkdev_class(unsigned int major, const char *description,
     unsigned int (* blkdev_read_impl)  (unsigned int, offset_t, unsigned int, void *),
     unsigned int (* blkdev_write_impl) (unsigned int, offset_t, unsigned int, void *));
@@ -59,6 +61,16 @@ void exception_set_handler(unsigned int numex, exception_handler_t fn);
 void init_exceptions();
 
 
+/*===========================================================================*
+ * fpu.c                                                                     *
+ *===========================================================================*/
+
+void fpu_switch(struct task_struct *next);
+ret_t fpu_fork(struct task_struct *t);
+void fpu_exit(struct task_struct *t);
+void init_fpu(void);
+
+
 /*===========================================================================*
  * gdt.c                                                                     *
  *===========================================================================*/
@@ -115,15 +127,24 @@ void init_kbd(void);
  * kmem.c                                                                    *
  *===========================================================================*/
 
+void init_kmem(void);
 void *kmalloc(size_t size);
 void *__kmalloc(size_t size);
 void kfree(void *ptr);
+struct kmem_slab;
+struct kmem_slab *kmem_slab_create(const char *name, size_t size, kmem_ctor_t ctor);
+void *kmem_slab_alloc(struct kmem_slab *slab);
+struct kmem_slab_stats;
+unsigned int get_kmem_slab_stats(struct kmem_slab_stats *stats, unsigned int n);
+unsigned int get_kmalloc_stats(struct kmem_slab_stats *stats, unsigned int n);
 
 
 /*===========================================================================*
  * ksync.c                                                                   *
  *===========================================================================*/
 
+void init_ksync(void);
+
 struct ksema;
 struct ksema *ksema_init(unsigned int initval);
 ret_t ksema_free(struct ksema *sem);
@@ -152,8 +173,17 @@ void panic(const char *format, ...);
 void init_physmem(size_t memsize);
 ret_t alloc_physmem_block(size_t pages, addr_t *paddr);
 ret_t __alloc_physmem_block(size_t pages, addr_t *paddr);
+ret_t alloc_physmem_aligned_block(unsigned int order, addr_t *paddr);
+bool_t has_free_physmem_block(unsigned int order);
 ret_t free_physmem_block(addr_t addr);
+size_t get_physmem_block_size(addr_t addr);
 ret_t realloc_physmem_block(addr_t addr, size_t pages, addr_t *paddr);
+bool_t zero_free_page(void);
+ret_t set_physmem_block_mover(addr_t addr, physmem_mover_t mover, void *owner);
+ret_t register_physmem_shrinker(physmem_shrinker_t shrinker);
+size_t get_physmem_largest_hole(void);
+size_t compact_physmem(size_t pages);
+void compaction_task(void);
 
 
 /*===========================================================================*
@@ -165,24 +195,50 @@ ret_t create_ramdisk(size_t len, unsigned int *minor);
 void destroy_ramdisk(unsigned int minor);
 
 
+/*===========================================================================*
+ * rbtree.c                                                                  *
+ *===========================================================================*/
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root);
+void rb_erase(struct rb_node *node, struct rb_root *root);
+struct rb_node *rb_first(const struct rb_root *root);
+struct rb_node *rb_next(const struct rb_node *node);
+
+
 /*===========================================================================*
  * sched.c                                                                   *
  *===========================================================================*/
 
 pid_t alloc_pid(void);
+void free_pid(pid_t pid);
 struct task_struct *get_task(pid_t pid);
 void init_multitasking(void);
+void add_task(struct task_struct *t);
+void remove_task(struct task_struct *t);
+void sched_tick(void);
+void set_task_nice(struct task_struct *t, int nice);
+ret_t set_task_scheduler(struct task_struct *t, int policy, int priority);
+bool_t has_runnable_tasks(void);
 void schedule(void);
 void wake_up(struct task_struct *t);
 void sleep_on();
-void interruptible_sleep_on();
+
+
+/*===========================================================================*
+ * sys.c                                                                     *
+ *===========================================================================*/
+
+void init_sysenter(void);
 
 
 /*===========================================================================*
  * task.c                                                                    *
  *===========================================================================*/
 
+void init_task_slab(void);
+struct task_struct *alloc_task_struct(void);
 pid_t kernel_thread(task_entry_point_t fn);
+void reparent_children(struct task_struct *t, struct task_struct *parent);
 void do_exit(int status);
 void do_sleep(unsigned long msec);
 pid_t do_waitpid(pid_t pid, int *status);
@@ -201,6 +257,24 @@ void task_switch(struct task_struct *t);
 
 void init_timer(void);
 void init_wall_clock(void);
+void set_realtime(time_t t);
+void stop_idle_countdown(void);
+void idle_halt(void);
+struct timer;
+void setup_timer(struct timer *timer, timer_fn_t fn, void *data);
+void add_timer(struct timer *timer);
+bool_t del_timer(struct timer *timer);
+
+
+/*===========================================================================*
+ * wait.c                                                                    *
+ *===========================================================================*/
+
+struct wait_queue;
+ret_t wait_event(struct wait_queue *wq, wait_cond_t cond, void *data,
+    bool_t exclusive, unsigned long timeout);
+void wait_queue_wake(struct wait_queue *wq);
+void wait_queue_wake_all(struct wait_queue *wq);
 
 
 #endif /* _SIMPLIX_PROTO_H_ */
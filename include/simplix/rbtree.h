@@ -0,0 +1,66 @@
+/*===========================================================================
+ *
+ * rbtree.h
+ *
+ * Copyright (C) 2007 - Julien Lecomte
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ *===========================================================================
+ *
+ * Red-black trees (see rbtree.c)
+ *
+ * The nodes are embedded in the structures that are sorted. The tree code
+ * does not know how these structures compare, so inserting a node is done
+ * in two steps: the caller walks down the tree to find where the new node
+ * belongs, links it there using rb_link_node, and then calls rb_insert_color
+ * to rebalance the tree.
+ *
+ *===========================================================================*/
+
+#ifndef _SIMPLIX_RBTREE_H_
+#define _SIMPLIX_RBTREE_H_
+
+#include <simplix/types.h>
+
+#define RB_RED   0
+#define RB_BLACK 1
+
+struct rb_node {
+    struct rb_node *parent, *left, *right;
+    int color;
+};
+
+struct rb_root {
+    struct rb_node *node;
+};
+
+/* Returns the structure of the specified type, in which the specified node
+   is embedded as the specified member. */
+#define rb_entry(ptr, type, member) \
+    ((type *) ((char *) (ptr) - (addr_t) &((type *) 0)->member))
+
+/* Links the specified new node to the tree, as the specified child (left or
+   right, passed as a pointer to the corresponding member) of the specified
+   parent, or as the root of the tree if parent is NULL. */
+#define rb_link_node(node, parent_node, link) \
+do {                                          \
+    (node)->parent = (parent_node);           \
+    (node)->left = (node)->right = NULL;      \
+    (node)->color = RB_RED;                   \
+    *(link) = (node);                         \
+} while (0)
+
+#endif /* _SIMPLIX_RBTREE_H_ */
@@ -0,0 +1,157 @@
+/*===========================================================================
+ *
+ * stats.h
+ *
+ * Copyright (C) 2007 - Julien Lecomte
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ *===========================================================================
+ *
+ * Counters used to keep track of the behavior of the kernel subsystems.
+ *
+ *===========================================================================*/
+
+#ifndef _SIMPLIX_STATS_H_
+#define _SIMPLIX_STATS_H_
+
+/* Note: This file does not depend on any other kernel header, so that it can
+   also be included by programs running on the build host (see tools/) */
+
+/* Physical memory statistics (see physmem.c) */
+
+struct physmem_stats {
+
+    /* Number of free pages. */
+    unsigned long free_pages;
+
+    /* Number of free pages known to be filled with zeros. */
+    unsigned long clean_pages;
+
+    /* Number of pages filled with zeros by the idle task. */
+    unsigned long idle_zeroed_pages;
+
+    /* Number of pages filled with zeros on the allocation path. */
+    unsigned long sync_zeroed_pages;
+
+    /* Number of requests for zeroed memory. */
+    unsigned long zeroed_allocs;
+
+    /* Number of requests for zeroed memory entirely served from pages
+       that were already clean. */
+    unsigned long clean_hits;
+
+    /* Number of bytes copied to a new location by realloc_physmem_block. */
+    unsigned long realloc_copied_bytes;
+
+    /* Number of bytes moved down by realloc_physmem_block to make use of the
+       free memory preceding a block. */
+    unsigned long realloc_moved_bytes;
+
+    /* Number of bytes that did not need to be copied because a block could
+       be grown in place, or because the data segment of a task could grow
+       in the memory reserved for it (see sys_brk) */
+    unsigned long realloc_avoided_bytes;
+
+    /* Number of times physical memory was compacted. */
+    unsigned long compaction_runs;
+
+    /* Number of bytes moved by compaction. */
+    unsigned long compaction_moved_bytes;
+
+    /* Number of pages in the largest run of free pages, as of the last time
+       it was computed (see compact_physmem) */
+    unsigned long largest_hole;
+
+    /* Number of times the shrinkers were called, and number of pages they
+       released. */
+    unsigned long shrinker_runs;
+    unsigned long shrunk_pages;
+};
+
+/* Scheduler statistics (see sched.c) Latencies are expressed in CPU cycles,
+   as counted by the time-stamp counter. */
+
+struct sched_stats {
+
+    /* Number of tasks woken up, and number of times a woken up task got
+       the CPU right away (see WAKEUP_PREEMPTION) */
+    unsigned long wakeups;
+    unsigned long wakeup_preemptions;
+
+    /* Total and maximum time between the moment a task is woken up and the
+       moment it gets the CPU. */
+    unsigned long long wakeup_latency;
+    unsigned long max_wakeup_latency;
+
+    /* Number of times real-time tasks were throttled (see RT_RUNTIME) */
+    unsigned long rt_throttles;
+
+    /* Number of times a task went to sleep on a wait queue, and number of
+       times it was woken up while the condition it was waiting for was
+       still false (see wait.c) */
+    unsigned long waits;
+    unsigned long spurious_wakeups;
+
+    /* Number of task switches, number of Device Not Available exceptions
+       raised by tasks using the FPU without owning it, and number of FPU
+       states saved and restored by these exceptions (see fpu.c) Every task
+       switch that did not cause an exception avoided both a save and a
+       restore. */
+    unsigned long context_switches;
+    unsigned long fpu_traps;
+    unsigned long fpu_saves;
+    unsigned long fpu_restores;
+};
+
+/* Statistics of a slab of kernel objects (see kmem.c) */
+
+struct kmem_slab_stats {
+
+    /* Name of the slab, or NULL for the slabs used by kmalloc. */
+    const char *name;
+
+    /* Size of the objects in this slab. */
+    unsigned long object_size;
+
+    /* Number of objects currently allocated. */
+    unsigned long active_objects;
+
+    /* Number of objects the caches of this slab can hold. */
+    unsigned long total_objects;
+
+    /* Number of caches in this slab, and number of these caches that are
+       empty. */
+    unsigned long caches;
+    unsigned long empty_caches;
+
+    /* Number of pages used by the caches of this slab. */
+    unsigned long pages;
+
+    /* Order of the next cache created in this slab. */
+    unsigned long cache_order;
+
+    /* Number of caches given back to the physical memory allocator. */
+    unsigned long released_caches;
+
+    /* Number of allocations and frees. */
+    unsigned long allocs;
+    unsigned long frees;
+
+    /* Number of times the constructor of this slab was called. */
+    unsigned long ctor_calls;
+};
+
+#endif /* _SIMPLIX_STATS_H_ */
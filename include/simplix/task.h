@@ -29,29 +29,60 @@
 
 #include <simplix/consts.h>
 #include <simplix/context.h>
+#include <simplix/rbtree.h>
 #include <simplix/segment.h>
 #include <simplix/types.h>
+#include <simplix/wait.h>
 
 /* Task descriptor. */
 
 struct task_struct {
 
+    /* This task's CPU context i.e. the value of the stack pointer right
+       before a task switch. This must remain the first member, since its
+       offset is hard-coded in task_switch.S (see TASK_CTX in context.h) */
+    struct task_cpu_context *ctx;
+
     /* Task unique identifier. */
     pid_t pid;
 
     /* Parent task unique identifier. */
     pid_t ppid;
 
+    /* Parent task. Only the idle task, and the kernel threads started before
+       it, do not have one (see init_multitasking) */
+    struct task_struct *parent;
+
+    /* Children tasks that are still running, and children tasks that have
+       terminated but have not been waited for yet. */
+    struct task_struct *children, *zombies;
+
+    /* Wait queue of this task while it waits for one of its children to
+       terminate (see do_waitpid) */
+    struct wait_queue wait_child_exit;
+
     /* CPU time used by this task, expressed in number of timer ticks. */
     unsigned long cputime;
 
-    /* Time (in clock ticks) remaining before this task becomes runnable again.
-       This is used by the sleep system call. */
-    unsigned long timeout;
+    /* Nice value, going from NICE_MIN (highest priority) to NICE_MAX
+       (lowest priority) See set_task_nice. */
+    int nice;
+
+    /* Virtual run time charged to this task for every tick it runs, which is
+       inversely proportional to its weight (see sched.c) */
+    unsigned long vslice;
+
+    /* Virtual run time of this task. The run queue is sorted by this value. */
+    unsigned long long vruntime;
+
+    /* Scheduling policy (SCHED_NORMAL, SCHED_FIFO or SCHED_RR) and, for the
+       real-time policies, priority going from 0 to RT_PRIO_MAX. */
+    int policy;
+    unsigned int rt_priority;
 
-    /* Remaining time slice expressed in number of timer ticks.
-       Always remains at 0 for the idle task. */
-    unsigned int timeslice;
+    /* Remaining time slice of a SCHED_RR task, expressed in number of timer
+       ticks. */
+    unsigned int rt_timeslice;
 
     /* The current state of this task. */
     int state;
@@ -65,12 +96,32 @@ struct task_struct {
     /* This task's local descriptor table (LDT) */
     struct segment_descriptor ldt[NR_LDT_ENTRIES];
 
-    /* This task's CPU context i.e. the value of the stack pointer right
-       before a task switch. */
-    struct task_cpu_context *ctx;
+    /* Saved FPU and SSE registers of this task, allocated the first time it
+       uses the FPU, or NULL if it never has (see fpu.c) */
+    void *fpu;
 
     /* Linkage pointers in the global task list. */
     struct task_struct *prev, *next;
+
+    /* Linkage pointers in the pid hash table. */
+    struct task_struct *hash_prev, *hash_next;
+
+    /* Linkage pointers in the children or zombies list of the parent task. */
+    struct task_struct *sibling_prev, *sibling_next;
+
+    /* Value of the time-stamp counter when this task was last woken up, or
+       0 if it got the CPU since. */
+    unsigned long long wakeup_tsc;
+
+    /* Number of CPU cycles between the last time this task was woken up and
+       the moment it got the CPU. */
+    unsigned long wakeup_latency;
+
+    /* Node of this task in the run queue. */
+    struct rb_node rq_node;
+
+    /* Linkage pointers in the real-time run queue. */
+    struct task_struct *rt_prev, *rt_next;
 };
 
 #endif /* _SIMPLIX_TASK_H_ */
@@ -0,0 +1,54 @@
+/*===========================================================================
+ *
+ * timer.h
+ *
+ * Copyright (C) 2007 - Julien Lecomte
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ *===========================================================================
+ *
+ * Data structures related to kernel timers (see timer.c)
+ *
+ *===========================================================================*/
+
+#ifndef _SIMPLIX_TIMER_H_
+#define _SIMPLIX_TIMER_H_
+
+#include <simplix/types.h>
+
+/* Kernel timer. Timers are usually embedded in another structure, or
+   allocated on the stack of the task waiting for them. They must be set up
+   using setup_timer before being used. */
+
+struct timer {
+
+    /* Value of the global tick count at which this timer expires. */
+    unsigned long expires;
+
+    /* Function called, with hardware interrupts disabled, when this timer
+       expires, and the argument it is called with. */
+    timer_fn_t fn;
+    void *data;
+
+    /* Linkage pointers in the timing wheel. next is NULL if this timer is
+       not pending. */
+    struct timer *prev, *next;
+};
+
+/* Whether the specified timer is pending, i.e. armed and not expired yet. */
+#define timer_pending(timer) ((timer)->next != NULL)
+
+#endif /* _SIMPLIX_TIMER_H_ */
@@ -93,5 +93,31 @@ typedef void (* exception_handler_t)(uint32_t esp);
 /* Kernel thread entry point. */
 typedef void (* task_entry_point_t)(void);
 
+/* Function called before a block of physical memory gets moved (see
+   set_physmem_block_mover in physmem.c) */
+typedef bool_t (* physmem_mover_t)(void *owner, addr_t new_addr);
+
+/* Function called to release memory when an allocation is about to fail
+   (see register_physmem_shrinker in physmem.c) */
+typedef size_t (* physmem_shrinker_t)(void);
+
+/* Constructor of the objects of a slab (see kmem_slab_create in kmem.c) */
+typedef void (* kmem_ctor_t)(void *object);
+
+/* Function called when a kernel timer expires (see add_timer in timer.c) */
+typedef void (* timer_fn_t)(void *data);
+
+/* Condition a task waits for (see wait_event in wait.c) */
+typedef bool_t (* wait_cond_t)(void *data);
+
+/* System call submitted as part of a batch (see sys_syscall_batch in sys.c)
+   The arguments go where the system call expects them in EBX, ECX and EDX,
+   and the kernel stores the value the system call returned in result. */
+struct syscall_record {
+    unsigned long nr;
+    unsigned long args[3];
+    long result;
+};
+
 
 #endif /* _SIMPLIX_TYPES_H_ */
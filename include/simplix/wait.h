@@ -0,0 +1,74 @@
+/*===========================================================================
+ *
+ * wait.h
+ *
+ * Copyright (C) 2007 - Julien Lecomte
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ *===========================================================================
+ *
+ * Data structures related to wait queues (see wait.c)
+ *
+ *===========================================================================*/
+
+#ifndef _SIMPLIX_WAIT_H_
+#define _SIMPLIX_WAIT_H_
+
+#include <simplix/types.h>
+
+struct task_struct;
+
+/* Entry of a task in a wait queue. It lives on the stack of the waiting task
+   (see wait_event) */
+
+struct wait_queue_entry {
+
+    /* The waiting task. */
+    struct task_struct *task;
+
+    /* Whether waking up this task should stop the wake-up of the following
+       waiters (see wait_queue_wake) */
+    bool_t exclusive;
+
+    /* Whether this entry is in the wait queue. Waking up a task removes its
+       entry from the queue, so it cannot be woken up twice. */
+    bool_t queued;
+
+    /* Whether the wait ended because its timeout expired, i.e. the timeout
+       expired while this entry was still in the wait queue, or while the
+       task was waiting on no queue at all. */
+    bool_t timed_out;
+
+    /* The wait queue this entry belongs to. */
+    struct wait_queue *wq;
+
+    /* Linkage pointers in the wait queue. */
+    struct wait_queue_entry *prev, *next;
+};
+
+/* Wait queue. Non-exclusive waiters are queued ahead of exclusive ones, so
+   waking up the queue wakes up all the former and the first of the latter.
+   A wait queue can be initialized statically using WAIT_QUEUE_INIT. */
+
+struct wait_queue {
+    struct wait_queue_entry *head;
+};
+
+#define WAIT_QUEUE_INIT { NULL }
+
+#define init_wait_queue(wq) ((wq)->head = NULL)
+
+#endif /* _SIMPLIX_WAIT_H_ */
@@ -29,6 +29,7 @@
 
 void *memset(void *s, int c, size_t size);
 void *memcpy(void *dest, const void *src, size_t n);
+void *memmove(void *dest, const void *src, size_t n);
 int vsnprintf(char *str, size_t size, const char *format, va_list ap);
 int snprintf(char *str, size_t size, const char *format, ...);
 size_t strlen(const char *str);
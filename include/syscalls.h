@@ -18,103 +18,164 @@
  * with this program; if not, write to the Free Software Foundation, Inc.,
  * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  *
+ *===========================================================================
+ *
+ * System call wrappers. They all go through syscall_entry (see syscall.S)
+ * which uses the SYSENTER instruction when the processor supports it, and
+ * int SYSCALL_INT_NUM otherwise. Except for time, getpid and getppid, which
+ * read the kernel information segment (see kinfo.h) instead.
+ *
  *===========================================================================*/
 
 #ifndef _SYSCALLS_H_
 #define _SYSCALLS_H_
 
 #include <simplix/consts.h>
+#include <simplix/kinfo.h>
 #include <simplix/types.h>
 
 static inline void exit(int status)
 {
-    asm("int %2"
+    asm("call syscall_entry"
         :
         : "a" (SYSCALL_EXIT),
-          "b" (status),
-          "i" (SYSCALL_INT_NUM));
+          "b" (status));
 }
 
 static inline pid_t fork(void)
 {
     pid_t pid;
-    asm("int %2"
+    asm("call syscall_entry"
         : "=a" (pid)
-        : "a" (SYSCALL_FORK),
-          "i" (SYSCALL_INT_NUM));
+        : "a" (SYSCALL_FORK));
     return pid;
 }
 
 static inline pid_t waitpid(pid_t pid, int *status)
 {
-    asm("int %4"
+    asm("call syscall_entry"
         : "=a" (pid)
         : "a" (SYSCALL_WAITPID),
           "b" (pid),
-          "c" (status),
-          "i" (SYSCALL_INT_NUM));
+          "c" (status));
     return pid;
 }
 
 static inline pid_t getpid(void)
 {
+    unsigned long seq;
     pid_t pid;
-    asm("int %2"
-        : "=a" (pid)
-        : "a" (SYSCALL_GETPID),
-          "i" (SYSCALL_INT_NUM));
+    do {
+        seq = kinfo_read(seq);
+        pid = kinfo_read(pid);
+    } while (kinfo_read(seq) != seq);
     return pid;
 }
 
 static inline pid_t getppid(void)
 {
+    unsigned long seq;
     pid_t ppid;
-    asm("int %2"
-        : "=a" (ppid)
-        : "a" (SYSCALL_GETPPID),
-          "i" (SYSCALL_INT_NUM));
+    do {
+        seq = kinfo_read(seq);
+        ppid = kinfo_read(ppid);
+    } while (kinfo_read(seq) != seq);
     return ppid;
 }
 
 static inline time_t time(void)
 {
+    unsigned long seq;
     time_t t;
-    asm("int %2"
-        : "=a" (t)
-        : "a" (SYSCALL_TIME),
-          "i" (SYSCALL_INT_NUM));
+    do {
+        seq = kinfo_read(seq);
+        t = kinfo_read(realtime);
+    } while (kinfo_read(seq) != seq);
     return t;
 }
 
 static inline int stime(time_t *t)
 {
     int res;
-    asm("int %3"
+    asm("call syscall_entry"
         : "=a" (res)
         : "a" (SYSCALL_STIME),
-          "b" (t),
-          "i" (SYSCALL_INT_NUM));
+          "b" (t));
     return res;
 }
 
 static inline void sleep(unsigned int msec)
 {
-    asm("int %2"
+    asm("call syscall_entry"
         :
         : "a" (SYSCALL_SLEEP),
-          "b" (msec),
-          "i" (SYSCALL_INT_NUM));
+          "b" (msec));
 }
 
 static inline size_t brk(size_t data_segment_size)
 {
     size_t res;
-    asm("int %3"
+    asm("call syscall_entry"
         : "=a" (res)
         : "a" (SYSCALL_BRK),
-          "b" (data_segment_size),
-          "i" (SYSCALL_INT_NUM));
+          "b" (data_segment_size));
+    return res;
+}
+
+static inline int nice(int inc)
+{
+    int res;
+    asm("call syscall_entry"
+        : "=a" (res)
+        : "a" (SYSCALL_NICE),
+          "b" (inc));
     return res;
 }
 
+static inline int setpriority(pid_t pid, int nice)
+{
+    int res;
+    asm("call syscall_entry"
+        : "=a" (res)
+        : "a" (SYSCALL_SETPRIORITY),
+          "b" (pid),
+          "c" (nice));
+    return res;
+}
+
+static inline int sched_setscheduler(pid_t pid, int policy, int priority)
+{
+    int res;
+    asm("call syscall_entry"
+        : "=a" (res)
+        : "a" (SYSCALL_SCHED_SETSCHEDULER),
+          "b" (pid),
+          "c" (policy),
+          "d" (priority));
+    return res;
+}
+
+/* Makes the system calls described by the specified records in a single trip
+   through the kernel, stopping at the first one that fails. Returns how many
+   succeeded, or -1 if the records are invalid. */
+static inline int syscall_batch(struct syscall_record *records, unsigned int n)
+{
+    int res;
+    asm("call syscall_entry"
+        : "=a" (res)
+        : "a" (SYSCALL_BATCH),
+          "b" (records),
+          "c" (n)
+        : "memory");
+    return res;
+}
+
+/* Reserved to the idle task. Never returns. */
+static inline void idle_loop(void)
+{
+    asm("call syscall_entry"
+        :
+        : "a" (SYSCALL_IDLE));
+}
+
 #endif /* _SYSCALLS_H_ */
@@ -91,6 +91,20 @@ struct blkdev_instance {
 /* The list of block device classes. */
 struct blkdev_class *blkdev_classes[NR_BLKDEV_MAJOR_TYPES] = { NULL, };
 
+/* Slab of block device instances. */
+static struct kmem_slab *blkdev_instance_slab;
+
+/*
+ * Initializes the block device subsystem.
+ */
+void init_blkdev(void)
+{
+    blkdev_instance_slab = kmem_slab_create("blkdev",
+        sizeof(struct blkdev_instance), NULL);
+    if (!blkdev_instance_slab)
+        panic("Could not create the slab of block device instances");
+}
+
 /*
  * Returns the block device instance of the specified class and minor number,
  * and increments its reference count.
@@ -196,7 +210,7 @@ ret_t register_blkdev_instance(unsigned int major, unsigned int minor,
         return S_OK;
     }
 
-    dev = __kmalloc(sizeof(struct blkdev_instance));
+    dev = kmem_slab_alloc(blkdev_instance_slab);
     if (!dev)
         return -E_NOMEM;
 
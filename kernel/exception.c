@@ -106,11 +106,6 @@ static void invalid_opcode_exception(uint32_t esp)
     handle_exception("Invalid Opcode Exception", esp);
 }
 
-static void device_not_available_exception(uint32_t esp)
-{
-    handle_exception("Device Not Available Exception", esp);
-}
-
 static void coprocessor_segment_overrun_exception(uint32_t esp)
 {
     handle_exception("Coprocessor Segment Overrun Exception", esp);
@@ -157,7 +152,8 @@ static void machine_check_exception(uint32_t esp)
 }
 
 /*
- * Set exception handlers on standard exceptions.
+ * Set exception handlers on standard exceptions. The Device Not Available
+ * exception is handled by the FPU code (see init_fpu)
  */
 void init_exceptions()
 {
@@ -168,7 +164,6 @@ void init_exceptions()
     exception_set_handler(EXCEPT_OVERFLOW, &overflow_exception);
     exception_set_handler(EXCEPT_BOUND_RANGE_EXCEDEED, &bound_range_exceeded_exception);
     exception_set_handler(EXCEPT_INVALID_OPCODE, &invalid_opcode_exception);
-    exception_set_handler(EXCEPT_DEVICE_NOT_AVAILABLE, &device_not_available_exception);
     exception_set_handler(EXCEPT_COPROCESSOR_SEGMENT_OVERRUN, &coprocessor_segment_overrun_exception);
     exception_set_handler(EXCEPT_INVALID_TSS, &invalid_tss_exception);
     exception_set_handler(EXCEPT_SEGMENT_NOT_PRESENT, &segment_not_present_exception);
@@ -0,0 +1,299 @@
+/*===========================================================================
+ *
+ * fpu.c
+ *
+ * Copyright (C) 2007 - Julien Lecomte
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ *===========================================================================
+ *
+ * Lazy FPU context switching. Saving and restoring the x87 FPU and SSE
+ * registers (512 bytes with FXSAVE) at every task switch would be a waste,
+ * since most tasks never use them. Instead, the FPU registers keep the state
+ * of the last task that used them (fpu_owner) and, when another task gets
+ * the CPU, the TS flag of CR0 is set. The first FPU or SSE instruction this
+ * task executes then raises a Device Not Available exception (#NM), whose
+ * handler saves the registers of the previous owner, restores the ones of
+ * the current task, and clears TS. A task that does not touch the FPU while
+ * it has the CPU costs nothing, and neither does switching back to the owner.
+ *
+ * The state of a task is allocated the first time it uses the FPU, and
+ * initialized from the state of a freshly reset FPU.
+ *
+ *===========================================================================*/
+
+#include <string.h>
+
+#include <simplix/consts.h>
+#include <simplix/globals.h>
+#include <simplix/macros.h>
+#include <simplix/proto.h>
+#include <simplix/stats.h>
+#include <simplix/task.h>
+#include <simplix/types.h>
+
+/* Size of the area saved by FXSAVE (x87 FPU, MMX and SSE registers), and by
+   FNSAVE on processors that lack FXSAVE (x87 FPU registers only) */
+#define FXSAVE_SIZE 512
+#define FNSAVE_SIZE 108
+
+/* FXSAVE and FXRSTOR require a 16-byte aligned area, but slab objects are
+   only aligned on 8 bytes, so we align FPU states within their object. */
+#define FPU_STATE_ALIGN 16
+#define fpu_state(obj) \
+    ((void *) (((addr_t) (obj) + FPU_STATE_ALIGN - 1) & ~(FPU_STATE_ALIGN - 1)))
+
+/* Bits of the CR0 and CR4 control registers, and of the feature flags
+   returned in EDX by CPUID. */
+#define CR0_MP          (1 << 1)
+#define CR0_EM          (1 << 2)
+#define CR0_TS          (1 << 3)
+#define CR0_NE          (1 << 5)
+#define CR4_OSFXSR      (1 << 9)
+#define CR4_OSXMMEXCPT  (1 << 10)
+#define CPUID_FXSR      (1 << 24)
+#define CPUID_SSE       (1 << 25)
+
+/* Value of the MXCSR register after a reset: all SSE exceptions masked. */
+#define MXCSR_DEFAULT   0x1f80
+
+#define read_cr0() ({                               \
+    unsigned long __ret;                            \
+    asm volatile("mov %%cr0, %0" : "=r" (__ret));   \
+    __ret;                                          \
+})
+
+#define write_cr0(val) asm volatile("mov %0, %%cr0" :: "r" (val))
+
+/* Task whose FPU state is currently loaded in the FPU registers, if any. */
+static struct task_struct *fpu_owner = NULL;
+
+/* Whether the TS flag of CR0 is currently set. Keeping track of it spares us
+   reading CR0, which is a serializing instruction, on every task switch. */
+static bool_t fpu_ts = FALSE;
+
+/* Whether the processor supports FXSAVE / FXRSTOR, and SSE. */
+static bool_t has_fxsr = FALSE;
+static bool_t has_sse = FALSE;
+
+/* Slab of task FPU states, and state of a freshly reset FPU, which is copied
+   into the state of a task the first time it uses the FPU. */
+static struct kmem_slab *fpu_slab;
+static byte_t initial_fpu_state[FXSAVE_SIZE + FPU_STATE_ALIGN - 1];
+
+static inline void set_ts(void)
+{
+    if (!fpu_ts) {
+        write_cr0(read_cr0() | CR0_TS);
+        fpu_ts = TRUE;
+    }
+}
+
+static inline void clear_ts(void)
+{
+    if (fpu_ts) {
+        asm volatile("clts");
+        fpu_ts = FALSE;
+    }
+}
+
+/*
+ * Saves the FPU registers into the specified state. Note that FNSAVE also
+ * reinitializes the FPU, so the registers must be considered lost afterwards.
+ */
+static inline void save_fpu_state(void *state)
+{
+    if (has_fxsr)
+        asm volatile("fxsave (%0)" :: "r" (state) : "memory");
+    else
+        asm volatile("fnsave (%0); fwait" :: "r" (state) : "memory");
+}
+
+static inline void restore_fpu_state(void *state)
+{
+    if (has_fxsr)
+        asm volatile("fxrstor (%0)" :: "r" (state) : "memory");
+    else
+        asm volatile("frstor (%0)" :: "r" (state) : "memory");
+}
+
+/*
+ * Saves the FPU registers into the state of their owner, and sets TS so that
+ * the next FPU instruction traps. Hardware interrupts must be disabled.
+ */
+static void unload_fpu(void)
+{
+    if (fpu_owner) {
+        clear_ts();
+        save_fpu_state(fpu_state(fpu_owner->fpu));
+        sched_stats.fpu_saves++;
+        fpu_owner = NULL;
+    }
+
+    set_ts();
+}
+
+/*
+ * Handles the Device Not Available exception, raised by the first FPU or SSE
+ * instruction a task executes after getting the CPU if it does not own the
+ * FPU registers.
+ */
+static void handle_fpu_trap(uint32_t esp)
+{
+    sched_stats.fpu_traps++;
+
+    if (fpu_owner == current) {
+        /* Nothing to switch. */
+        clear_ts();
+        return;
+    }
+
+    if (!current->fpu) {
+        current->fpu = kmem_slab_alloc(fpu_slab);
+        if (!current->fpu) {
+            printk("[pid %u] Out of memory for FPU state\n", current->pid);
+            do_exit(1);
+        }
+        memcpy(fpu_state(current->fpu), fpu_state(initial_fpu_state),
+            has_fxsr ? FXSAVE_SIZE : FNSAVE_SIZE);
+    }
+
+    clear_ts();
+
+    if (fpu_owner) {
+        save_fpu_state(fpu_state(fpu_owner->fpu));
+        sched_stats.fpu_saves++;
+    }
+
+    restore_fpu_state(fpu_state(current->fpu));
+    sched_stats.fpu_restores++;
+    fpu_owner = current;
+}
+
+/*
+ * Called by the scheduler right before giving the CPU to the specified task.
+ * The FPU registers are left alone: the task will trap if it uses them and
+ * does not own them. Hardware interrupts must be disabled.
+ */
+void fpu_switch(struct task_struct *next)
+{
+    sched_stats.context_switches++;
+
+    if (next == fpu_owner)
+        clear_ts();
+    else
+        set_ts();
+}
+
+/*
+ * Copies the FPU state of the current task, if it has one, to the specified
+ * new child task. Returns S_OK on success, or -E_NOMEM, in which case the
+ * child has no FPU state to free.
+ */
+ret_t fpu_fork(struct task_struct *t)
+{
+    unsigned long eflags;
+
+    t->fpu = NULL;
+
+    if (!current->fpu)
+        return S_OK;
+
+    t->fpu = kmem_slab_alloc(fpu_slab);
+    if (!t->fpu)
+        return -E_NOMEM;
+
+    disable_hwint(eflags);
+
+    /* Bring the state of the current task up to date in memory. */
+    if (fpu_owner == current)
+        unload_fpu();
+
+    memcpy(fpu_state(t->fpu), fpu_state(current->fpu),
+        has_fxsr ? FXSAVE_SIZE : FNSAVE_SIZE);
+
+    restore_hwint(eflags);
+
+    return S_OK;
+}
+
+/*
+ * Releases the FPU state of the specified terminating task. Hardware
+ * interrupts must be disabled.
+ */
+void fpu_exit(struct task_struct *t)
+{
+    if (fpu_owner == t) {
+        /* The registers hold nothing worth saving anymore, but the next
+           task using them must still trap to load its own state. */
+        fpu_owner = NULL;
+        set_ts();
+    }
+
+    if (t->fpu) {
+        kfree(t->fpu);
+        t->fpu = NULL;
+    }
+}
+
+/*
+ * Initializes the FPU, enables SSE if it is available, and sets up lazy FPU
+ * context switching.
+ */
+void init_fpu(void)
+{
+    unsigned long eax, ebx, ecx, edx, cr4;
+
+    if (has_cpuid()) {
+        cpuid(1, eax, ebx, ecx, edx);
+        has_fxsr = (edx & CPUID_FXSR) != 0;
+        has_sse = has_fxsr && (edx & CPUID_SSE) != 0;
+    }
+
+    /* Use the FPU rather than emulating it, make WAIT/FWAIT honor TS, and
+       report FPU errors through the Floating-Point Error exception. */
+    write_cr0((read_cr0() & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE);
+    fpu_ts = FALSE;
+
+    if (has_fxsr) {
+        /* Tell the processor we save the SSE registers on task switches,
+           and that we handle SSE exceptions. CR4 only exists on processors
+           recent enough to support FXSAVE. */
+        asm volatile("mov %%cr4, %0" : "=r" (cr4));
+        cr4 |= CR4_OSFXSR;
+        if (has_sse)
+            cr4 |= CR4_OSXMMEXCPT;
+        asm volatile("mov %0, %%cr4" :: "r" (cr4));
+    }
+
+    /* Record the state of a freshly reset FPU. */
+    asm volatile("fninit");
+    if (has_sse) {
+        unsigned long mxcsr = MXCSR_DEFAULT;
+        asm volatile("ldmxcsr %0" :: "m" (mxcsr));
+    }
+    save_fpu_state(fpu_state(initial_fpu_state));
+
+    fpu_slab = kmem_slab_create("fpu",
+        (has_fxsr ? FXSAVE_SIZE : FNSAVE_SIZE) + FPU_STATE_ALIGN - 1, NULL);
+    if (!fpu_slab)
+        panic("Cannot create the FPU state slab");
+
+    /* Nobody owns the FPU yet. */
+    set_ts();
+
+    exception_set_handler(EXCEPT_DEVICE_NOT_AVAILABLE, &handle_fpu_trap);
+}
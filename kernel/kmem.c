@@ -22,47 +22,81 @@
  *
  * This is a high performance memory cache for the Simplix kernel.
  *
+ * Objects do not carry any header. Each cache is a block of physical memory
+ * aligned on its own size, so the cache an object belongs to is found by
+ * masking the address of that object. Since caches may have different sizes,
+ * the order of the cache each page belongs to is stored in a table indexed
+ * by page frame number. Free objects are chained together through their
+ * first word.
+ *
+ * kmalloc serves objects from an array of slabs indexed by size. Subsystems
+ * that frequently allocate objects of a given type can also create their own
+ * named slab (see kmem_slab_create) with a constructor, which is called once
+ * per slot when a cache is created rather than on every allocation.
+ *
+ * Objects too large for the slabs are made of whole pages. Their size is
+ * rounded up to a power of two pages, and a few freed blocks of each size are
+ * kept in page pools for the next allocations. The largest objects are
+ * allocated from, and given back to, the physical memory allocator directly.
+ * kfree tells these objects apart from the objects of a slab by a flag in the
+ * table of cache orders.
+ *
+ * The caches of a slab are kept in three lists: partial caches, which still
+ * have unallocated objects, full caches and empty caches. Objects are taken
+ * from partial caches first, so that allocated objects are packed in as few
+ * caches as possible, then from empty caches, and a new cache is only
+ * created when there is none left. Caches that become empty are given back
+ * to the physical memory allocator, except for a few of them per slab, which
+ * are kept around for the next allocations. These are released too when
+ * physical memory runs out (see shrink_kmem)
+ *
  *===========================================================================*/
 
 #include <string.h>
 
 #include <simplix/assert.h>
 #include <simplix/consts.h>
+#include <simplix/globals.h>
 #include <simplix/list.h>
 #include <simplix/macros.h>
 #include <simplix/proto.h>
+#include <simplix/stats.h>
 #include <simplix/types.h>
 
 /*
- * This structure represents a block of physical memory. It is 12 bytes long on
- * 32 bit architectures, which is fairly large, especially compared to some of
- * the smaller objects this allocator deals with. However, memory is cheap
- * nowadays, and CPU time is always a precious commodity, so it's fine.
+ * This structure represents the link between free objects. Allocated objects
+ * have no header at all, so the smallest objects this allocator deals with
+ * (8 bytes) are stored without any overhead. The link is usually stored in
+ * the first word of a free object, except in slabs with a constructor, where
+ * it follows the object so as not to overwrite its constructed state.
  */
 struct kmem_object {
 
-    /* The cache this block belongs to. */
-    struct kmem_cache *cache;
-
-    /* Doubly linked list pointers. */
-    struct kmem_object *prev, *next;
+    /* Next free object in the same cache. */
+    void *next;
 };
 
 /*
  * This structure represents a block of contiguous physical memory allocated by
  * the physical memory manager. All the smaller objects this allocator deals
- * with are contained within such blocks.
+ * with are contained within such blocks. It is located at the beginning of
+ * the block.
  */
 struct kmem_cache {
 
     /* The slab this cache belongs to. */
     struct kmem_slab *slab;
 
-    /* Number of unallocated objects in this cache. */
+    /* This cache spans 1 << order pages. */
+    unsigned int order;
+
+    /* Number of objects in this cache, and how many of them are
+       unallocated. */
+    unsigned int nr_objects;
     unsigned int nr_free_objects;
 
-    /* List of free objects in this cache. */
-    struct kmem_object *free_object_list_head;
+    /* Singly linked list of free objects in this cache. */
+    void *free_object_list_head;
 
     /* Doubly linked list pointers. */
     struct kmem_cache *prev, *next;
@@ -73,17 +107,73 @@ struct kmem_cache {
  */
 struct kmem_slab {
 
-    /* List of caches within this slab. */
-    struct kmem_cache *cache_list_head;
+    /* Lists of caches within this slab, depending on how many of their
+       objects are allocated: some of them, all of them, or none of them. */
+    struct kmem_cache *partial_cache_list_head;
+    struct kmem_cache *full_cache_list_head;
+    struct kmem_cache *empty_cache_list_head;
+
+    /* Size of the slots holding the objects of this slab. */
+    size_t size;
+
+    /* Order of the next cache created in this slab, and lowest order a
+       cache of this slab can have (see get_cache_order) */
+    unsigned int order;
+    unsigned int min_order;
+
+    /* Value of stats.allocs the last time a cache was created. */
+    unsigned long last_cache_allocs;
+
+    /* Offset of the link between free objects within a slot. */
+    size_t link;
+
+    /* Function called on every object of a newly created cache, or NULL. */
+    kmem_ctor_t ctor;
+
+    /* Statistics. The name of the slabs used by kmalloc is NULL. */
+    struct kmem_slab_stats stats;
+
+    /* Linkage pointers in the list of named slabs. */
+    struct kmem_slab *prev, *next;
 };
 
 /*
- * Caches have a static size. This means that the list of caches in slabs
- * containing large objects can be quite long. However, by making sure that the
- * cache at the beginning of that list always contains at least one unallocated
- * object, this design decision does not impact allocation performance.
+ * Caches span 1 << order pages, and are aligned on their size. The order of
+ * the caches of a slab is adjusted depending on how many objects that slab
+ * allocates per cache it creates (see get_cache_order) Allocating an object
+ * only requires looking at the first partial or empty cache of a slab, so
+ * the number of caches does not impact allocation performance.
  */
-#define NR_PAGES_PER_KMEM_CACHE 8
+#define KMEM_MAX_CACHE_ORDER 4
+
+/* Minimum number of objects in a cache. */
+#define KMEM_MIN_OBJECTS_PER_CACHE 8
+
+/* Cache churn thresholds, in cachefuls of allocations per cache created. The
+   caches of a slab get bigger if it allocated less than KMEM_GROW_CHURN
+   cachefuls of objects since it last created a cache, i.e. if it goes
+   through caches quickly. They get smaller if it allocated more than
+   KMEM_SHRINK_CHURN cachefuls, i.e. if its caches last long. */
+#define KMEM_GROW_CHURN 2
+#define KMEM_SHRINK_CHURN 16
+
+/* Order of the cache each page of physical memory belongs to, plus one, or 0
+   if that page does not belong to a cache. The first page of a large object
+   holds KMEM_LARGE_OBJECT instead, along with the index of its page pool. */
+static uint8_t *page_cache_orders;
+
+#define KMEM_LARGE_OBJECT 0x80
+
+/* Returns the cache containing the specified object. */
+#define get_object_cache(ptr)                                                 \
+    ((struct kmem_cache *) ((addr_t) (ptr) &                                  \
+        ~((PAGE_SIZE << (page_cache_orders[(addr_t) (ptr) >> PAGE_BIT_SHIFT]  \
+            - 1)) - 1)))
+
+/* Returns the link to the next free object stored in the specified free
+   object of the specified slab. */
+#define get_free_link(slab, object) \
+    (((struct kmem_object *) ((addr_t) (object) + (slab)->link))->next)
 
 /* Expression of the granularity of this allocator in bytes (1 << 3 = 8) */
 #define KMEM_CACHE_GRANULARITY 3
@@ -95,6 +185,23 @@ struct kmem_slab {
 #define KMEM_CACHE_MIN_OBJ_SIZE (1 << KMEM_CACHE_GRANULARITY)
 #define KMEM_CACHE_MAX_OBJ_SIZE (KMEM_SLAB_ARRAY_SIZE << KMEM_CACHE_GRANULARITY)
 
+/* Offset of the first object in a cache. Objects are aligned on the
+   granularity of this allocator. */
+#define KMEM_CACHE_HEADER_SIZE \
+    ((sizeof(struct kmem_cache) + KMEM_CACHE_MIN_OBJ_SIZE - 1) & \
+     ~(KMEM_CACHE_MIN_OBJ_SIZE - 1))
+
+/* Large objects of up to 1 << (KMEM_NR_PAGE_POOLS - 1) pages come from page
+   pools, each of which keeps up to KMEM_PAGE_POOL_BLOCKS_KEPT freed blocks
+   for later use. */
+#define KMEM_NR_PAGE_POOLS (KMEM_MAX_CACHE_ORDER + 1)
+#define KMEM_PAGE_POOL_BLOCKS_KEPT 4
+
+/* Number of empty caches a slab keeps for later use. This avoids allocating
+   and releasing the same cache over and over when the number of objects in
+   a slab oscillates around a multiple of the number of objects per cache. */
+#define KMEM_EMPTY_CACHES_KEPT 1
+
 /*
  * Array of slabs, indexed by the size of the objects they contain:
  *
@@ -111,73 +218,424 @@ static struct kmem_slab slabs[KMEM_SLAB_ARRAY_SIZE] = {
     { NULL },
 };
 
+/* List of named slabs. */
+static struct kmem_slab *named_slab_list_head = NULL;
+
 /*
- * Same as kmalloc, but does not zero-out the allocated block of memory.
+ * This structure represents a pool of blocks of 1 << order pages, which hold
+ * large objects.
  */
-void *__kmalloc(size_t size)
+struct kmem_page_pool {
+
+    /* Singly linked list of free blocks kept in this pool. */
+    void *free_block_list_head;
+
+    /* Statistics. Each block counts as a cache holding a single object. */
+    struct kmem_slab_stats stats;
+};
+
+/*
+ * Array of page pools, indexed by the order of their blocks. The last entry
+ * only keeps track of the objects too large for the pools, which are never
+ * kept once freed.
+ */
+static struct kmem_page_pool page_pools[KMEM_NR_PAGE_POOLS + 1];
+
+/*
+ * Moves the specified cache from one list of caches of a slab to the
+ * beginning of another.
+ */
+#define move_cache(cache, from_list_head, to_list_head) \
+do {                                                    \
+    list_remove(from_list_head, cache);                 \
+    list_append(to_list_head, cache);                   \
+    (to_list_head) = (cache);                           \
+} while (0)
+
+/* Returns the number of objects of the specified slab fitting in a cache of
+   the specified order. */
+#define get_nr_objects(slab, order) \
+    (((PAGE_SIZE << (order)) - KMEM_CACHE_HEADER_SIZE) / (slab)->size)
+
+/*
+ * Initializes the specified slab, the objects of which are stored in slots
+ * of the specified size.
+ */
+static void init_slab(struct kmem_slab *slab, size_t size)
+{
+    slab->size = size;
+    slab->min_order = 0;
+    while (slab->min_order < KMEM_MAX_CACHE_ORDER &&
+           get_nr_objects(slab, slab->min_order) < KMEM_MIN_OBJECTS_PER_CACHE)
+        slab->min_order++;
+    slab->order = slab->min_order;
+    slab->stats.cache_order = slab->order;
+}
+
+/*
+ * Returns the order of the cache the specified slab is about to create.
+ * Slabs whose caches last long, and slabs of large objects, get small
+ * caches, so that little memory is wasted on objects that are not allocated.
+ * Slabs that keep needing new caches get larger caches, which saves trips to
+ * the physical memory allocator. This cache churn is measured by the number
+ * of allocations the slab served since it last created a cache, not by a
+ * rate over time. Hardware interrupts must be disabled.
+ */
+static unsigned int get_cache_order(struct kmem_slab *slab)
+{
+    unsigned long allocs;
+    unsigned int n;
+
+    if (slab->stats.allocs) {
+        allocs = slab->stats.allocs - slab->last_cache_allocs;
+        n = get_nr_objects(slab, slab->order);
+        if (allocs < n * KMEM_GROW_CHURN &&
+            slab->order < KMEM_MAX_CACHE_ORDER)
+            slab->order++;
+        else if (allocs > n * KMEM_SHRINK_CHURN &&
+                 slab->order > slab->min_order)
+            slab->order--;
+        slab->stats.cache_order = slab->order;
+    }
+
+    slab->last_cache_allocs = slab->stats.allocs;
+    return slab->order;
+}
+
+/*
+ * Allocates a new cache for the specified slab and adds it to the list of
+ * empty caches of that slab. Returns NULL if we are out of memory. Hardware
+ * interrupts must be disabled, and eflags is the value saved when they were,
+ * since they get restored while physical memory is being compacted.
+ */
+static struct kmem_cache *create_cache(struct kmem_slab *slab,
+    unsigned long eflags)
 {
-    int idx;
-    size_t cache_size, object_size;
     addr_t cache_addr, object_addr;
-    struct kmem_slab *slab;
+    unsigned int order, pfn;
     struct kmem_cache *cache;
-    struct kmem_object *object;
-    unsigned long eflags;
+    ret_t res;
+
+    /* If memory is too fragmented to get a cache of the desired size, try
+       smaller ones. Compacting physical memory and calling the shrinkers
+       is expensive, so this is only done, once, when there is no free block
+       large enough for even the smallest cache. Hardware interrupts are
+       serviced in the meantime. */
+    order = get_cache_order(slab);
+    while (order > slab->min_order && !has_free_physmem_block(order))
+        order--;
+    if (has_free_physmem_block(order)) {
+        res = alloc_physmem_aligned_block(order, &cache_addr);
+    } else {
+        restore_hwint(eflags);
+        res = alloc_physmem_aligned_block(order, &cache_addr);
+        disable_hwint(eflags);
+    }
+    if (res != S_OK)
+        return NULL;
+
+    for (pfn = 0; pfn < (1 << order); pfn++)
+        page_cache_orders[(cache_addr >> PAGE_BIT_SHIFT) + pfn] = order + 1;
+
+    /* Initialize the newly created cache. */
+    cache = (struct kmem_cache *) cache_addr;
+    cache->slab = slab;
+    cache->order = order;
+    cache->nr_objects = get_nr_objects(slab, order);
+    cache->nr_free_objects = cache->nr_objects;
+    cache->free_object_list_head = NULL;
+
+    /* Initialize the list of unallocated objects in the newly created cache.
+       The list is built backward, so that objects get allocated in ascending
+       address order. */
+    for (object_addr = cache_addr + KMEM_CACHE_HEADER_SIZE +
+             (cache->nr_free_objects - 1) * slab->size;
+         object_addr >= cache_addr + KMEM_CACHE_HEADER_SIZE;
+         object_addr -= slab->size) {
+        if (slab->ctor) {
+            slab->ctor((void *) object_addr);
+            slab->stats.ctor_calls++;
+        }
+        get_free_link(slab, object_addr) = cache->free_object_list_head;
+        cache->free_object_list_head = (void *) object_addr;
+    }
 
-    ASSERT(size > 0 && size < KMEM_CACHE_MAX_OBJ_SIZE);
+    slab->stats.caches++;
+    slab->stats.empty_caches++;
+    slab->stats.total_objects += cache->nr_objects;
+    slab->stats.pages += 1 << order;
 
-    disable_hwint(eflags);
+    list_append(slab->empty_cache_list_head, cache);
+    return cache;
+}
 
-    /* Find the slab corresponding to the specified size. */
-    idx = (size - 1) >> KMEM_CACHE_GRANULARITY;
-    slab = &slabs[idx];
+/*
+ * Removes the specified empty cache from the specified slab, and gives it back
+ * to the physical memory allocator. Hardware interrupts must be disabled.
+ */
+static void release_cache(struct kmem_slab *slab, struct kmem_cache *cache)
+{
+    list_remove(slab->empty_cache_list_head, cache);
+    slab->stats.caches--;
+    slab->stats.empty_caches--;
+    slab->stats.total_objects -= cache->nr_objects;
+    slab->stats.pages -= 1 << cache->order;
+    slab->stats.released_caches++;
+    memset(&page_cache_orders[(addr_t) cache >> PAGE_BIT_SHIFT], 0,
+        1 << cache->order);
+    free_physmem_block((addr_t) cache);
+}
 
-    /* Look in the cache at the beginning of the slab for a free object. */
-    cache = slab->cache_list_head;
+/*
+ * Releases all the empty caches of the specified slab. Returns the number of
+ * pages given back to the physical memory allocator. Hardware interrupts must
+ * be disabled.
+ */
+static size_t shrink_slab(struct kmem_slab *slab)
+{
+    size_t pages = 0;
 
-    if (!cache || !cache->nr_free_objects) {
+    while (!list_empty(slab->empty_cache_list_head)) {
+        pages += 1 << slab->empty_cache_list_head->order;
+        release_cache(slab, slab->empty_cache_list_head);
+    }
 
-        /* Either this slab has not yet been initialized, or all the
-           caches in this slab are full. Let's allocate a new cache. */
-        if (alloc_physmem_block(NR_PAGES_PER_KMEM_CACHE, &cache_addr) != S_OK) {
-            restore_hwint(eflags);
-            return NULL;
-        }
+    return pages;
+}
 
-        /* Compute the actual size of the slots in that cache. */
-        size = idx << KMEM_CACHE_GRANULARITY;
-
-        /* Initialize the newly created cache. */
-        cache = (struct kmem_cache *) cache_addr;
-        cache->slab = slab;
-        cache_size = NR_PAGES_PER_KMEM_CACHE << PAGE_BIT_SHIFT;
-        object_size = sizeof(struct kmem_object) + size;
-        cache->nr_free_objects = (cache_size - sizeof(struct kmem_cache)) / object_size;
-
-        /* Initialize the list of unallocated objects in the newly created cache. */
-        for (object_addr = cache_addr + sizeof(struct kmem_cache);
-             object_addr < cache_addr + cache_size;
-             object_addr += object_size) {
-            object = (struct kmem_object *) object_addr;
-            object->cache = cache;
-            list_append(cache->free_object_list_head, object);
+/*
+ * Gives the specified block of the specified page pool, which holds no
+ * object anymore, back to the physical memory allocator. Hardware interrupts
+ * must be disabled.
+ */
+static void release_page_block(struct kmem_page_pool *pool, void *block,
+    size_t pages)
+{
+    pool->stats.caches--;
+    pool->stats.total_objects--;
+    pool->stats.pages -= pages;
+    pool->stats.released_caches++;
+    page_cache_orders[(addr_t) block >> PAGE_BIT_SHIFT] = 0;
+    free_physmem_block((addr_t) block);
+}
+
+/*
+ * Shrinker of this allocator (see register_physmem_shrinker) Releases all
+ * the empty caches, and all the blocks kept in the page pools.
+ */
+static size_t shrink_kmem(void)
+{
+    int i;
+    size_t pages = 0;
+    struct kmem_slab *slab;
+    struct kmem_page_pool *pool;
+    void *block;
+
+    for (i = 0; i < KMEM_SLAB_ARRAY_SIZE; i++)
+        if (slabs[i].stats.empty_caches)
+            pages += shrink_slab(&slabs[i]);
+
+    for (i = 0; i < KMEM_NR_PAGE_POOLS; i++) {
+        pool = &page_pools[i];
+        while ((block = pool->free_block_list_head)) {
+            pool->free_block_list_head = ((struct kmem_object *) block)->next;
+            pool->stats.empty_caches--;
+            release_page_block(pool, block, 1 << i);
+            pages += 1 << i;
         }
+    }
+
+    list_for_each(named_slab_list_head, slab, i)
+        if (slab->stats.empty_caches)
+            pages += shrink_slab(slab);
+
+    return pages;
+}
+
+/*
+ * Initializes the kernel memory allocator.
+ */
+void init_kmem(void)
+{
+    addr_t addr;
+    size_t pages;
+    int i;
+
+    /* The table of cache orders has one byte per page. */
+    pages = PAGE_ALIGN_SUP(physmem_size >> PAGE_BIT_SHIFT) >> PAGE_BIT_SHIFT;
+    if (alloc_physmem_block(pages, &addr) != S_OK)
+        panic("Initialization of kernel memory allocator failed.");
+    page_cache_orders = (uint8_t *) addr;
+
+    for (i = 0; i <= KMEM_NR_PAGE_POOLS; i++) {
+        page_pools[i].stats.object_size =
+            i < KMEM_NR_PAGE_POOLS ? PAGE_SIZE << i : 0;
+        page_pools[i].stats.cache_order = i;
+    }
+
+    register_physmem_shrinker(&shrink_kmem);
+}
+
+/*
+ * Takes an object out of the specified slab. Returns NULL if we are out of
+ * memory.
+ */
+static void *alloc_object(struct kmem_slab *slab)
+{
+    struct kmem_cache *cache;
+    void *object;
+    unsigned long eflags;
+
+    disable_hwint(eflags);
 
-        /* Prepend the newly created cache to the corresponding slab. */
-        list_append(slab->cache_list_head, cache);
-        slab->cache_list_head = cache;
+    /* Look for a free object in the first partial cache of the slab, or in
+       its first empty cache. If there is none, all the caches in this slab
+       are full. Let's allocate a new cache. */
+    cache = slab->partial_cache_list_head;
+
+    if (!cache) {
+        cache = slab->empty_cache_list_head;
+        if (!cache) {
+            cache = create_cache(slab, eflags);
+            if (!cache) {
+                restore_hwint(eflags);
+                return NULL;
+            }
+        }
+        move_cache(cache, slab->empty_cache_list_head,
+            slab->partial_cache_list_head);
+        slab->stats.empty_caches--;
     }
 
+    if (cache->nr_free_objects == 1)
+        move_cache(cache, slab->partial_cache_list_head,
+            slab->full_cache_list_head);
+
     /* Remove the object from the cache, and return its address. */
     cache->nr_free_objects--;
-    object = list_pop_head(cache->free_object_list_head);
+    object = cache->free_object_list_head;
+    cache->free_object_list_head = get_free_link(slab, object);
+    slab->stats.allocs++;
+    slab->stats.active_objects++;
     restore_hwint(eflags);
-    return (void *) ((addr_t) object + sizeof(struct kmem_object));
+    return object;
+}
+
+/*
+ * Allocates a large object made of whole pages. Returns NULL if we are out of
+ * memory.
+ */
+static void *alloc_large_object(size_t size)
+{
+    unsigned int order;
+    size_t pages;
+    struct kmem_page_pool *pool;
+    addr_t addr;
+    void *object = NULL;
+    unsigned long eflags;
+
+    /* Find the page pool corresponding to the specified size. */
+    pages = PAGE_ALIGN_SUP(size) >> PAGE_BIT_SHIFT;
+    order = 0;
+    while (order < KMEM_NR_PAGE_POOLS && (1 << order) < pages)
+        order++;
+    pool = &page_pools[order];
+
+    disable_hwint(eflags);
+
+    /* Reuse a block kept in the pool, if any. */
+    if (order < KMEM_NR_PAGE_POOLS && pool->free_block_list_head) {
+        object = pool->free_block_list_head;
+        pool->free_block_list_head = ((struct kmem_object *) object)->next;
+        pool->stats.empty_caches--;
+        goto done;
+    }
+
+    /* Otherwise, allocate a new one. The physical memory allocator does not
+       need hardware interrupts to be disabled, and may have to compact
+       physical memory, so let them in. */
+    restore_hwint(eflags);
+
+    if (order < KMEM_NR_PAGE_POOLS) {
+        pages = 1 << order;
+        if (alloc_physmem_aligned_block(order, &addr) == S_OK)
+            object = (void *) addr;
+    } else if (__alloc_physmem_block(pages, &addr) == S_OK) {
+        object = (void *) addr;
+    }
+
+    if (!object)
+        return NULL;
+
+    disable_hwint(eflags);
+
+    page_cache_orders[(addr_t) object >> PAGE_BIT_SHIFT] =
+        KMEM_LARGE_OBJECT | order;
+    pool->stats.caches++;
+    pool->stats.total_objects++;
+    pool->stats.pages += pages;
+
+done:
+    pool->stats.allocs++;
+    pool->stats.active_objects++;
+    restore_hwint(eflags);
+    return object;
+}
+
+/*
+ * Frees the specified large object, which belongs to the specified page
+ * pool. Hardware interrupts must be disabled.
+ */
+static void free_large_object(void *object, unsigned int order)
+{
+    struct kmem_page_pool *pool = &page_pools[order];
+
+    pool->stats.frees++;
+    pool->stats.active_objects--;
+
+    /* Keep the block in its pool, unless that pool has enough of them. */
+    if (order < KMEM_NR_PAGE_POOLS &&
+        pool->stats.empty_caches < KMEM_PAGE_POOL_BLOCKS_KEPT) {
+        ((struct kmem_object *) object)->next = pool->free_block_list_head;
+        pool->free_block_list_head = object;
+        pool->stats.empty_caches++;
+        return;
+    }
+
+    release_page_block(pool, object, order < KMEM_NR_PAGE_POOLS ? 1 << order :
+        get_physmem_block_size((addr_t) object));
+}
+
+/*
+ * Same as kmalloc, but does not zero-out the allocated block of memory.
+ */
+void *__kmalloc(size_t size)
+{
+    int idx;
+    struct kmem_slab *slab;
+
+    ASSERT(size > 0);
+
+    if (size > KMEM_CACHE_MAX_OBJ_SIZE)
+        return alloc_large_object(size);
+
+    /* Find the slab corresponding to the specified size. */
+    idx = (size - 1) >> KMEM_CACHE_GRANULARITY;
+    slab = &slabs[idx];
+
+    /* Compute the actual size of the slots in that slab. */
+    if (!slab->size) {
+        init_slab(slab, (idx + 1) << KMEM_CACHE_GRANULARITY);
+        slab->stats.object_size = slab->size;
+    }
+
+    return alloc_object(slab);
 }
 
 /*
  * Allocates a block of physical memory of the specified size and returns
- * its address. The allocated block of memory is filled with zeros.
+ * its address. The allocated block of memory is filled with zeros. Blocks
+ * larger than KMEM_CACHE_MAX_OBJ_SIZE bytes are made of whole pages.
  */
 void *kmalloc(size_t size)
 {
@@ -188,29 +646,146 @@ void *kmalloc(size_t size)
 }
 
 /*
- * Frees the block of physical memory allocated using kmalloc or __kmalloc
- * and located at the specified address.
+ * Frees the block of physical memory allocated using kmalloc, __kmalloc or
+ * kmem_slab_alloc and located at the specified address. Objects allocated
+ * from a slab with a constructor must be returned in their constructed
+ * state.
  */
 void kfree(void *ptr)
 {
-    struct kmem_object *object;
     struct kmem_cache *cache;
     struct kmem_slab *slab;
+    unsigned int order;
     unsigned long eflags;
 
     disable_hwint(eflags);
 
+    order = page_cache_orders[(addr_t) ptr >> PAGE_BIT_SHIFT];
+    if (order & KMEM_LARGE_OBJECT) {
+        free_large_object(ptr, order & ~KMEM_LARGE_OBJECT);
+        restore_hwint(eflags);
+        return;
+    }
+
     /* Find out which cache and slab this object belongs to. */
-    object = (struct kmem_object *) ((addr_t) ptr - sizeof(struct kmem_object));
-    cache = object->cache;
+    cache = get_object_cache(ptr);
     slab = cache->slab;
 
     /* Return the object to the cache. */
-    list_append(cache->free_object_list_head, object);
+    get_free_link(slab, ptr) = cache->free_object_list_head;
+    cache->free_object_list_head = ptr;
     cache->nr_free_objects++;
+    slab->stats.frees++;
+    slab->stats.active_objects--;
+
+    /* Move the cache to the list it now belongs to. A cache that was full
+       goes to the beginning of the list of partial caches, so that its
+       free object is the next one to be allocated. */
+    if (cache->nr_free_objects == 1)
+        move_cache(cache, slab->full_cache_list_head,
+            slab->partial_cache_list_head);
+
+    if (cache->nr_free_objects == cache->nr_objects) {
+        /* This cache is now empty. Give it back to the physical memory
+           allocator, unless this slab does not have enough empty caches. */
+        move_cache(cache, slab->partial_cache_list_head,
+            slab->empty_cache_list_head);
+        slab->stats.empty_caches++;
+        if (slab->stats.empty_caches > KMEM_EMPTY_CACHES_KEPT)
+            release_cache(slab, cache);
+    }
+
+    restore_hwint(eflags);
+}
+
+/*
+ * Creates a slab dedicated to objects of the specified size. The constructor,
+ * if not NULL, is called on every object of a cache when that cache gets
+ * created. Objects allocated from this slab using kmem_slab_alloc are then
+ * already constructed, and must be freed (using kfree) in that same state.
+ * Returns NULL if we are out of memory.
+ */
+struct kmem_slab *kmem_slab_create(const char *name, size_t size,
+    kmem_ctor_t ctor)
+{
+    struct kmem_slab *slab;
+    unsigned long eflags;
+
+    ASSERT(size > 0 && size < KMEM_CACHE_MAX_OBJ_SIZE);
+
+    slab = kmalloc(sizeof(struct kmem_slab));
+    if (!slab)
+        return NULL;
+
+    /* The link between free objects can only be stored at the beginning of
+       the slots if there is no constructed state to preserve. */
+    slab->link = ctor ? (size + sizeof(struct kmem_object) - 1) &
+        ~(sizeof(struct kmem_object) - 1) : 0;
+    init_slab(slab, (slab->link + (ctor ? sizeof(struct kmem_object) : size) +
+        KMEM_CACHE_MIN_OBJ_SIZE - 1) & ~(KMEM_CACHE_MIN_OBJ_SIZE - 1));
+    slab->ctor = ctor;
+    slab->stats.name = name;
+    slab->stats.object_size = size;
+
+    disable_hwint(eflags);
+    list_append(named_slab_list_head, slab);
+    restore_hwint(eflags);
+
+    return slab;
+}
 
-    /* Place this cache at the beginning of the slab. */
-    slab->cache_list_head = cache;
+/*
+ * Allocates an object from the specified slab. The object is not filled
+ * with zeros. If the slab has a constructor, the object is in its constructed
+ * state. Returns NULL if we are out of memory.
+ */
+void *kmem_slab_alloc(struct kmem_slab *slab)
+{
+    return alloc_object(slab);
+}
+
+/*
+ * Copies the statistics of at most n of the slabs used by kmalloc to the
+ * specified array, starting with the slab of the smallest objects, followed
+ * by the statistics of the page pools. The last entry accounts for the
+ * objects too large for the page pools, and has an object size of 0. Returns
+ * the number of entries filled.
+ */
+unsigned int get_kmalloc_stats(struct kmem_slab_stats *stats, unsigned int n)
+{
+    unsigned int i;
+    unsigned long eflags;
+
+    disable_hwint(eflags);
+    for (i = 0; i < n && i < KMEM_SLAB_ARRAY_SIZE; i++) {
+        stats[i] = slabs[i].stats;
+        stats[i].object_size = (i + 1) << KMEM_CACHE_GRANULARITY;
+    }
+    for (; i < n && i <= KMEM_SLAB_ARRAY_SIZE + KMEM_NR_PAGE_POOLS; i++)
+        stats[i] = page_pools[i - KMEM_SLAB_ARRAY_SIZE].stats;
+    restore_hwint(eflags);
+
+    return i;
+}
+
+/*
+ * Copies the statistics of at most n named slabs to the specified array.
+ * Returns the number of entries filled.
+ */
+unsigned int get_kmem_slab_stats(struct kmem_slab_stats *stats, unsigned int n)
+{
+    int i;
+    unsigned int count = 0;
+    struct kmem_slab *slab;
+    unsigned long eflags;
 
+    disable_hwint(eflags);
+    list_for_each(named_slab_list_head, slab, i) {
+        if (count == n)
+            break;
+        stats[count++] = slab->stats;
+    }
     restore_hwint(eflags);
+
+    return count;
 }
@@ -35,6 +35,7 @@
 #include <simplix/proto.h>
 #include <simplix/task.h>
 #include <simplix/types.h>
+#include <simplix/wait.h>
 
 /*
  * This structure represents a kernel semaphore. This is an opaque structure
@@ -47,8 +48,9 @@ struct ksema {
        It represents the number of units of the resource which are free. */
     unsigned int value;
 
-    /* The ordered list of tasks waiting on this semaphore. */
-    struct task_struct *waiting_task_list_head;
+    /* The tasks waiting for this semaphore. They wait exclusively, since
+       only one of them can proceed when the semaphore is incremented. */
+    struct wait_queue wait;
 };
 
 /*
@@ -56,12 +58,37 @@ struct ksema {
  */
 typedef struct ksema kmutex;
 
+/* Slab of semaphores. */
+static struct kmem_slab *ksema_slab;
+
+/*
+ * Constructor of the semaphores in ksema_slab. A semaphore can only be freed
+ * if no task is waiting on it, so this is the state it is freed in as well.
+ */
+static void ksema_ctor(void *object)
+{
+    struct ksema *sem = object;
+
+    sem->value = 0;
+    init_wait_queue(&sem->wait);
+}
+
+/*
+ * Initializes the kernel synchronization primitives.
+ */
+void init_ksync(void)
+{
+    ksema_slab = kmem_slab_create("ksema", sizeof(struct ksema), &ksema_ctor);
+    if (!ksema_slab)
+        panic("Could not create the slab of semaphores");
+}
+
 /*
  * Creates a semaphore and initializes it with the specified integer value.
  */
 struct ksema *ksema_init(unsigned int initval)
 {
-    struct ksema *sem = __kmalloc(sizeof(struct ksema));
+    struct ksema *sem = kmem_slab_alloc(ksema_slab);
     if (sem)
         sem->value = initval;
     return sem;
@@ -74,7 +101,7 @@ ret_t ksema_free(struct ksema *sem)
 {
     unsigned long eflags;
     disable_hwint(eflags);
-    if (!list_empty(sem->waiting_task_list_head)) {
+    if (!list_empty(sem->wait.head)) {
         restore_hwint(eflags);
         return -E_BUSY;
     }
@@ -83,6 +110,14 @@ ret_t ksema_free(struct ksema *sem)
     return S_OK;
 }
 
+/*
+ * Returns whether the specified semaphore can be decremented.
+ */
+static bool_t ksema_available(void *data)
+{
+    return ((struct ksema *) data)->value != 0;
+}
+
 /*
  * Implements the DOWN operation on the specified kernel semaphore.
  * Do not call this function from an interrupt handler!
@@ -93,12 +128,10 @@ void ksema_down(struct ksema *sem)
 
     disable_hwint(eflags);
 
-    if (!sem->value) {
-        /* Append the current task to the semaphore's wait queue and sleep. */
-        list_append(sem->waiting_task_list_head, current);
-        current->state = TASK_UNINTERRUPTIBLE;
-        schedule();
-    }
+    /* Sleep until the value of the semaphore is not 0. Another task may
+       decrement it between the moment we are woken up and the moment we get
+       the CPU, so the value is checked again every time we wake up. */
+    wait_event(&sem->wait, &ksema_available, sem, TRUE, 0);
 
     /* Decrement the value of the semaphore. */
     sem->value--;
@@ -112,18 +145,14 @@ void ksema_down(struct ksema *sem)
 void ksema_up(struct ksema *sem)
 {
     unsigned long eflags;
-    struct task_struct *t;
 
     disable_hwint(eflags);
 
     /* Increment the value of the semaphore. */
     sem->value++;
 
-    /* Remove the first task from the semaphore's wait queue and wake it up! */
-    if (!list_empty(sem->waiting_task_list_head)) {
-        t = list_pop_head(sem->waiting_task_list_head);
-        t->state = TASK_RUNNABLE;
-    }
+    /* Wake up the first task waiting for the semaphore. */
+    wait_queue_wake(&sem->wait);
 
     restore_hwint(eflags);
 }
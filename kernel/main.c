@@ -41,14 +41,21 @@
    information below this row. This is used only for the test tasks. */
 static int gfx_base_row;
 
+/* Set while printk must not output anything. */
+bool_t printk_muted = FALSE;
+
 /* Forward declarations. */
 static void ide_driver_test_task(void);
 static void clock_task(void);
 static void prime_numbers_task(void);
 static void system_stat_task(void);
+static void fork_storm_task(void);
+static void ping_pong_task(void);
 static void init_task(void);
 static void process_demo_task(void);
 static void compute_pi_task();
+static void compute_pi_fpu_task(void);
+static void syscall_bench_task(void);
 
 /*
  * The Simplix kernel entry point.
@@ -77,6 +84,12 @@ void simplix_main(uint32_t memsize)
 
     /* Initialize physical memory allocator. */
     init_physmem(memsize);
+    init_kmem();
+
+    /* Create the slabs of the most frequently allocated kernel objects. */
+    init_task_slab();
+    init_ksync();
+    init_blkdev();
 
     /* Initialize hard drives. */
     init_ide_devices();
@@ -92,15 +105,23 @@ void simplix_main(uint32_t memsize)
     /* Handle exceptions. */
     init_exceptions();
 
+    /* Initialize the FPU, whose registers are switched lazily. */
+    init_fpu();
+
     /* Initialize the time-tracking subsystem. */
     init_timer();
     init_wall_clock();
 
     /* Start a few kernel threads, while we can. */
+    kernel_thread(compaction_task);
     kernel_thread(ide_driver_test_task);
     kernel_thread(clock_task);
     kernel_thread(prime_numbers_task);
     kernel_thread(system_stat_task);
+    if (BOOT_BENCHMARK == BENCHMARK_FORK_STORM)
+        kernel_thread(fork_storm_task);
+    else if (BOOT_BENCHMARK == BENCHMARK_PING_PONG)
+        kernel_thread(ping_pong_task);
 
     /* Initialize the multitasking subsystem. */
     init_multitasking();
@@ -115,8 +136,9 @@ void simplix_main(uint32_t memsize)
         init_task();
     } else {
         /* Note: We assume the above fork has succeeded!
-           This is the idle task. Just spin until the end of time. */
-        idle();
+           This is the idle task. Move to kernel space, where we will
+           spend the rest of our time zeroing free pages. */
+        idle_loop();
     }
 }
 
@@ -129,6 +151,9 @@ int printk(const char *format, ...)
     char buf[256];
     char *s = buf;
 
+    if (printk_muted)
+        return 0;
+
     va_start(ap, format);
     len = vsnprintf(buf, sizeof(buf), format, ap);
 
@@ -143,6 +168,7 @@ void panic(const char *format, ...)
     va_list ap;
 
     cli();
+    printk_muted = FALSE;
     va_start(ap, format);
     printk("KERNEL PANIC: ");
     printk(format, ap);
@@ -178,23 +204,42 @@ static void ide_driver_test_task(void)
 }
 
 /*
- * A kernel thread that displays a clock and updates it every second. Note that
- * making the thread sleep for a second and then update the display is not the
- * right way of doing this kind of thing. Indeed, the thread is not guaranteed
- * to sleep for exactly one second (actually, it'll sleep a little more than a
- * second) so a small delay will accumulate over time. The time displayed will
- * always be accurate at the time it is adjusted, but at some point in time,
- * the display will skip a second. No big deal, this is just an example...
+ * A kernel thread that displays a clock and updates it every second. It runs
+ * in the SCHED_FIFO real-time class, so it gets the CPU as soon as its timer
+ * expires, no matter how many CPU intensive tasks are runnable. It doubles as
+ * a jitter benchmark: next to the clock, it shows how long it waited for the
+ * CPU after being woken up, in thousands of CPU cycles, and how many ticks
+ * late it woke up relative to the start of the second, both for the last
+ * update and over the whole run. Change the policy below to SCHED_NORMAL to
+ * compare. Since each update is scheduled relative to the previous deadline
+ * rather than to the time the thread woke up, the delays do not accumulate.
  */
 static void clock_task(void)
 {
     char buf[256];
+    unsigned long deadline, late, max_late = 0, max_latency = 0;
+
+    set_task_scheduler(current, SCHED_FIFO, RT_PRIO_MAX);
+
+    deadline = ticks;
 
     for (;;) {
-        snprintf(buf, sizeof(buf), "Current Unix time is %u", realtime);
+        late = ticks - deadline;
+        if (late > max_late)
+            max_late = late;
+        if (current->wakeup_latency > max_latency)
+            max_latency = current->wakeup_latency;
+
+        snprintf(buf, sizeof(buf),
+            "Current Unix time is %u  latency: %u/%u Kcycles, %u/%u ticks",
+            realtime, current->wakeup_latency >> 10, max_latency >> 10,
+            late, max_late);
         /* Display the clock on the 4th line. */
         videomem_putstring(buf, gfx_base_row + 1, 0, DEFAULT_TEXT_ATTR);
-        do_sleep(1000);
+
+        deadline += HZ;
+        if (time_before(ticks, deadline))
+            do_sleep((deadline - ticks) * 1000 / HZ);
     }
 }
 
@@ -209,6 +254,10 @@ static void prime_numbers_task(void)
     int found;
     unsigned long num = 1, div;
 
+    /* This task is not in a hurry, so give it a smaller share of the CPU
+       than the other tasks when they have work to do. */
+    set_task_nice(current, 10);
+
     for (;;) {
         num++;
         found = 1;
@@ -229,8 +278,10 @@ static void prime_numbers_task(void)
 static void system_stat_task(void)
 {
     int i, row, col;
+    unsigned int n, len;
     char buf[256];
     struct task_struct *t;
+    struct kmem_slab_stats slab_stats[8];
     unsigned long cpu_usage;
     unsigned long last_tick;
     unsigned long eflags;
@@ -239,7 +290,7 @@ static void system_stat_task(void)
     #define HDR_TEXT_ATTR GFX_ATTR(GFX_BLACK, GFX_WHITE, GFX_STATIC)
     for (col = 0; col < SCREEN_COLS; col++)
         videomem_putchar(' ', gfx_base_row + 3, col, HDR_TEXT_ATTR);
-    videomem_putstring("  PID   %CPU", gfx_base_row + 3, 0, HDR_TEXT_ATTR);
+    videomem_putstring("  PID   %CPU   NI", gfx_base_row + 3, 0, HDR_TEXT_ATTR);
 
     for (;;) {
 
@@ -260,15 +311,213 @@ static void system_stat_task(void)
                 continue;
             cpu_usage = (t->cputime * 100) / (ticks - last_tick);
             t->cputime = 0;
-            snprintf(buf, sizeof(buf), "%.5u    %.3u", t->pid, cpu_usage);
+            if (t->policy == SCHED_NORMAL)
+                snprintf(buf, sizeof(buf), "%.5u    %.3u  %d", t->pid,
+                    cpu_usage, t->nice);
+            else
+                snprintf(buf, sizeof(buf), "%.5u    %.3u  RT%u", t->pid,
+                    cpu_usage, t->rt_priority);
             videomem_putstring(buf, row++, 0, DEFAULT_TEXT_ATTR);
         }
 
+        /* Show how long woken up tasks wait for the CPU, in thousands of CPU
+           cycles (see WAKEUP_PREEMPTION) */
+        snprintf(buf, sizeof(buf),
+            "Wakeups: %u  preempted: %u  latency avg/max: %u/%u Kcycles  RT throttled: %u",
+            sched_stats.wakeups, sched_stats.wakeup_preemptions,
+            sched_stats.wakeups ? (unsigned long)
+                (sched_stats.wakeup_latency >> 10) / sched_stats.wakeups : 0,
+            sched_stats.max_wakeup_latency >> 10, sched_stats.rt_throttles);
+        videomem_putstring(buf, SCREEN_ROWS - 5, 0, DEFAULT_TEXT_ATTR);
+
+        /* Show how often tasks waiting on a wait queue are woken up while
+           what they are waiting for has not happened yet, and how many task
+           switches had to save or restore FPU registers (see fpu.c) */
+        snprintf(buf, sizeof(buf),
+            "Waits: %u  spurious: %u  Switches: %u  FPU saves/restores: %u/%u",
+            sched_stats.waits, sched_stats.spurious_wakeups,
+            sched_stats.context_switches, sched_stats.fpu_saves,
+            sched_stats.fpu_restores);
+        videomem_putstring(buf, SCREEN_ROWS - 6, 0, DEFAULT_TEXT_ATTR);
+
+        /* Show how many objects are allocated in the named slabs, out of how
+           many the caches of these slabs can hold. */
+        n = get_kmem_slab_stats(slab_stats, 8);
+        snprintf(buf, sizeof(buf), "Slabs:");
+        for (i = 0, len = strlen(buf); i < n; i++, len = strlen(buf))
+            snprintf(buf + len, sizeof(buf) - len, "  %s %u/%u",
+                slab_stats[i].name, slab_stats[i].active_objects,
+                slab_stats[i].total_objects);
+        videomem_putstring(buf, SCREEN_ROWS - 4, 0, DEFAULT_TEXT_ATTR);
+
+        /* Show how compaction, the reallocation of physical memory blocks,
+           and the pool of pre-zeroed pages are doing on the last three lines
+           of the screen. */
+        snprintf(buf, sizeof(buf),
+            "Compactions: %u  bytes moved: %u  largest hole: %u/%u free pages",
+            physmem_stats.compaction_runs, physmem_stats.compaction_moved_bytes,
+            physmem_stats.largest_hole, physmem_stats.free_pages);
+        videomem_putstring(buf, SCREEN_ROWS - 3, 0, DEFAULT_TEXT_ATTR);
+
+        snprintf(buf, sizeof(buf),
+            "Realloc bytes copied: %u  moved down: %u  not copied: %u",
+            physmem_stats.realloc_copied_bytes, physmem_stats.realloc_moved_bytes,
+            physmem_stats.realloc_avoided_bytes);
+        videomem_putstring(buf, SCREEN_ROWS - 2, 0, DEFAULT_TEXT_ATTR);
+
+        snprintf(buf, sizeof(buf),
+            "Clean pages: %u  Clean hits: %u/%u  Zeroed by idle: %u, on demand: %u",
+            physmem_stats.clean_pages, physmem_stats.clean_hits,
+            physmem_stats.zeroed_allocs, physmem_stats.idle_zeroed_pages,
+            physmem_stats.sync_zeroed_pages);
+        videomem_putstring(buf, SCREEN_ROWS - 1, 0, DEFAULT_TEXT_ATTR);
+
         /* Leaving critical section... */
         restore_hwint(eflags);
     }
 }
 
+/* Number of tasks the fork storm benchmark creates and reaps in a row, and
+   number of additional tasks it keeps alive during its second run. */
+#define FORK_STORM_ROUNDS     256
+#define FORK_STORM_LIVE_TASKS 128
+
+/* Set once the fork storm benchmark does not need its live tasks anymore. */
+static volatile bool_t fork_storm_done = FALSE;
+
+static void fork_storm_child(void)
+{
+    do_exit(0);
+}
+
+static void fork_storm_sleeper(void)
+{
+    while (!fork_storm_done)
+        do_sleep(100);
+    do_exit(0);
+}
+
+/*
+ * Creates, and waits for the termination of, FORK_STORM_ROUNDS tasks that
+ * exit right away. Returns the average number of CPU cycles per task, in
+ * thousands. The kernel messages printed when a task is created, exits and
+ * gets reaped are muted meanwhile, since writing them out one character at
+ * a time would take much longer than what we are measuring.
+ */
+static unsigned long fork_storm(void)
+{
+    int i, status;
+    pid_t pid;
+    unsigned long long start, cycles;
+
+    printk_muted = TRUE;
+    start = rdtsc();
+
+    for (i = 0; i < FORK_STORM_ROUNDS; i++) {
+        pid = kernel_thread(fork_storm_child);
+        if (pid != -1)
+            do_waitpid(pid, &status);
+    }
+
+    cycles = rdtsc() - start;
+    printk_muted = FALSE;
+
+    return (unsigned long) (cycles >> 10) / FORK_STORM_ROUNDS;
+}
+
+/*
+ * A kernel thread that measures how long it takes to create a task, let it
+ * exit, and reap it, first with the tasks started at boot time, and then
+ * with FORK_STORM_LIVE_TASKS more tasks alive. The two results should be
+ * about the same. It only runs if BOOT_BENCHMARK is BENCHMARK_FORK_STORM.
+ * Take a look at bochs' standard output.
+ */
+static void fork_storm_task(void)
+{
+    int i, status;
+    unsigned long few, many;
+
+    few = fork_storm();
+
+    for (i = 0; i < FORK_STORM_LIVE_TASKS; i++)
+        kernel_thread(fork_storm_sleeper);
+
+    many = fork_storm();
+
+    fork_storm_done = TRUE;
+    while (do_waitpid(-1, &status) != -1)
+        continue;
+
+    printk("Fork storm: %u Kcycles per task, %u Kcycles with %u more tasks alive\n",
+        few, many, FORK_STORM_LIVE_TASKS);
+
+    do_exit(0);
+}
+
+/* Number of round trips of the ping-pong benchmark. */
+#define PING_PONG_ROUNDS 10000
+
+/* Semaphores the two tasks of the ping-pong benchmark hand the CPU over
+   with. */
+static struct ksema *ping_sema, *pong_sema;
+
+static void pong_task(void)
+{
+    int i;
+
+    set_task_scheduler(current, SCHED_FIFO, RT_PRIO_MAX - 1);
+
+    for (i = 0; i < PING_PONG_ROUNDS; i++) {
+        ksema_down(pong_sema);
+        ksema_up(ping_sema);
+    }
+
+    do_exit(0);
+}
+
+/*
+ * A kernel thread that measures the cost of a context switch, by handing the
+ * CPU back and forth to another task, twice per round trip. Both tasks run
+ * in the SCHED_FIFO class, so other tasks do not get in the way. It only
+ * runs if BOOT_BENCHMARK is BENCHMARK_PING_PONG. Take a look at bochs'
+ * standard output.
+ */
+static void ping_pong_task(void)
+{
+    int i, status;
+    pid_t pid;
+    unsigned long long start, cycles;
+
+    ping_sema = ksema_init(0);
+    pong_sema = ksema_init(0);
+    if (!ping_sema || !pong_sema)
+        do_exit(1);
+
+    set_task_scheduler(current, SCHED_FIFO, RT_PRIO_MAX - 1);
+
+    pid = kernel_thread(pong_task);
+    if (pid == -1)
+        do_exit(1);
+
+    start = rdtsc();
+
+    for (i = 0; i < PING_PONG_ROUNDS; i++) {
+        ksema_up(pong_sema);
+        ksema_down(ping_sema);
+    }
+
+    cycles = rdtsc() - start;
+
+    do_waitpid(pid, &status);
+    ksema_free(ping_sema);
+    ksema_free(pong_sema);
+
+    printk("Ping-pong: %u cycles per context switch\n",
+        (unsigned long) (cycles >> 1) / PING_PONG_ROUNDS);
+
+    do_exit(0);
+}
+
 /*
  * The init task. Right now, we don't have any user mode IO available, so we
  * just try to raise some exceptions, and test the fork and exit system calls.
@@ -277,7 +526,7 @@ static void system_stat_task(void)
 static void init_task(void)
 {
     pid_t pid;
-    int status;
+    int i, status;
 
     /* Start a user task that computes the number PI. */
     pid = fork();
@@ -286,6 +535,21 @@ static void init_task(void)
         exit(0);
     }
 
+    /* Start two user tasks that compute PI using the FPU, so their FPU
+       states have to be switched back and forth. */
+    for (i = 0; i < 2; i++) {
+        pid = fork();
+        if (pid == 0)
+            compute_pi_fpu_task();
+    }
+
+    /* Start a task that measures the cost of system calls. */
+    pid = fork();
+    if (pid == 0) {
+        syscall_bench_task();
+        exit(0);
+    }
+
     /* Start a demo task. */
     pid = fork();
     if (pid == 0) {
@@ -334,6 +598,70 @@ static void process_demo_task(void)
     }
 }
 
+/*
+ * Measures the latency of a null system call (getpid) made with int and with
+ * SYSENTER (see syscall.S), and of getpid reading the kernel information
+ * segment instead (see kinfo.h), and of getpid system calls submitted in
+ * batches (see sys_syscall_batch) Since user tasks have no way to output
+ * anything yet, each result, in CPU cycles per call, is reported as the exit
+ * status of a child task: look for the four children of this task exiting in
+ * bochs' standard output, in that order.
+ */
+
+#define SYSCALL_BENCH_SHIFT 14
+#define SYSCALL_BENCH_BATCH 16
+
+static void syscall_bench_task(void)
+{
+    struct syscall_record batch[SYSCALL_BENCH_BATCH];
+    unsigned long long start;
+    unsigned long i;
+    pid_t pid;
+    int status;
+
+    pid = fork();
+    if (pid == 0) {
+        start = rdtsc();
+        for (i = 0; i < (1 << SYSCALL_BENCH_SHIFT); i++)
+            asm volatile("int %1"
+                : "=a" (pid)
+                : "i" (SYSCALL_INT_NUM), "a" (SYSCALL_GETPID));
+        exit((unsigned long) (rdtsc() - start) >> SYSCALL_BENCH_SHIFT);
+    }
+    waitpid(pid, &status);
+
+    pid = fork();
+    if (pid == 0) {
+        start = rdtsc();
+        for (i = 0; i < (1 << SYSCALL_BENCH_SHIFT); i++)
+            asm volatile("call syscall_entry"
+                : "=a" (pid)
+                : "a" (SYSCALL_GETPID));
+        exit((unsigned long) (rdtsc() - start) >> SYSCALL_BENCH_SHIFT);
+    }
+    waitpid(pid, &status);
+
+    pid = fork();
+    if (pid == 0) {
+        start = rdtsc();
+        for (i = 0; i < (1 << SYSCALL_BENCH_SHIFT); i++)
+            pid = getpid();
+        exit((unsigned long) (rdtsc() - start) >> SYSCALL_BENCH_SHIFT);
+    }
+    waitpid(pid, &status);
+
+    pid = fork();
+    if (pid == 0) {
+        for (i = 0; i < SYSCALL_BENCH_BATCH; i++)
+            batch[i].nr = SYSCALL_GETPID;
+        start = rdtsc();
+        for (i = 0; i < (1 << SYSCALL_BENCH_SHIFT) / SYSCALL_BENCH_BATCH; i++)
+            syscall_batch(batch, SYSCALL_BENCH_BATCH);
+        exit((unsigned long) (rdtsc() - start) >> SYSCALL_BENCH_SHIFT);
+    }
+    waitpid(pid, &status);
+}
+
 /*
  * A user task that computes decimals of the number PI.
  *
@@ -568,3 +896,42 @@ static void compute_pi_task()
     free(buffer1);
     free(buffer2);
 }
+
+/*
+ * A user task that computes the number PI in double precision, using Machin's
+ * formula (see above) over and over again. Since it does the exact same
+ * floating-point operations every time, it must get the exact same result,
+ * unless its FPU registers got corrupted while it was preempted. It exits
+ * with status 0 if all the results matched, 1 otherwise.
+ */
+
+#define FPU_PI_ROUNDS 20000
+
+static double arctan_inv(long p)
+{
+    double x = 1.0 / p, x2 = x * x, term = x, sum = 0.0;
+    long k;
+
+    for (k = 1; term > 1e-17; k += 2) {
+        sum += (k & 2) ? -term / k : term / k;
+        term *= x2;
+    }
+
+    return sum;
+}
+
+static void compute_pi_fpu_task(void)
+{
+    double pi, first = 0.0;
+    int i;
+
+    for (i = 0; i < FPU_PI_ROUNDS; i++) {
+        pi = 4.0 * (4.0 * arctan_inv(5) - arctan_inv(239));
+        if (i == 0)
+            first = pi;
+        else if (pi != first)
+            exit(1);
+    }
+
+    exit(first > 3.14159265358979 && first < 3.1415926535898 ? 0 : 1);
+}
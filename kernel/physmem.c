@@ -22,7 +22,27 @@
  *
  * This file is concerned with keeping track of free and allocated segments of
  * physical memory with a granularity specified by the macro PAGE_BIT_SHIFT
- * defined in physmem.h.
+ * defined in consts.h.
+ *
+ * Free memory is managed using a binary buddy system: every free block spans
+ * a power of two number of pages and is naturally aligned on its own size.
+ * Free blocks are kept in one list per order, and a bitmap summarizes which
+ * of these lists are not empty, so finding a large enough free block only
+ * takes a bit scan. Allocated blocks, on the other hand, may span any number
+ * of pages: the unused tail of the buddy block they were carved from is
+ * immediately given back to the free lists.
+ *
+ * Each free block also remembers how many of its leading pages are known to
+ * be filled with zeros. When it has nothing better to do, the idle task fills
+ * free pages with zeros (see zero_free_page) Requests for zeroed memory are
+ * then served from these clean pages first, which saves the caller a memset.
+ *
+ * Finally, the owner of an allocated block may declare it movable by giving
+ * it a mover (see set_physmem_block_mover) When physical memory becomes too
+ * fragmented, movable blocks are slid toward low memory to coalesce holes
+ * (see compact_physmem) As a last resort, an allocation that cannot be
+ * satisfied asks the other memory allocators of the kernel to give back the
+ * memory they are holding on to without using it (see shrink_physmem)
  *
  *===========================================================================*/
 
@@ -33,20 +53,38 @@
 #include <simplix/list.h>
 #include <simplix/macros.h>
 #include <simplix/proto.h>
+#include <simplix/stats.h>
 #include <simplix/types.h>
 
 /*
- * This structure represents an available block of contiguous physical memory.
+ * This structure describes a page of physical memory. The descriptor of the
+ * first page of a block (free or allocated) describes the whole block. The
+ * descriptors of the other pages in that block are left blank (available is
+ * FALSE and pages is 0)
  */
 struct block {
 
     /* Number of pages in this block */
     unsigned int pages;
 
+    /* Order of this block (free blocks only) i.e. this block spans exactly
+       1 << order pages and is aligned on a multiple of its size. */
+    unsigned int order;
+
+    /* Number of pages, starting from the beginning of this block, that are
+       known to be filled with zeros (free blocks only) */
+    unsigned int zeroed;
+
     /* Flag indicating whether this block is a available or allocated. */
     bool_t available;
 
-    /* Doubly linked list pointers. */
+    /* Function called before this block gets moved, and the object it is
+       passed (allocated blocks only) This is NULL if the block cannot be
+       moved. */
+    physmem_mover_t mover;
+    void *owner;
+
+    /* Doubly linked list pointers (free blocks only) */
     struct block *prev, *next;
 };
 
@@ -54,27 +92,594 @@ struct block {
 #define BIOS_AND_VIDEO_MEMORY_START 0x0a0000
 #define BIOS_AND_VIDEO_MEMORY_END   0x100000
 
+/* Number of free block lists. The largest free block spans 1 << (NR_ORDERS-1)
+   pages, i.e. 2 GB with 4 KB pages. */
+#define NR_ORDERS 20
+
 /* Block descriptor array */
 static struct block *first_block_descriptor = NULL;
 
-/* List of blocks (allocated or not) in physical memory */
-static struct block *block_list_head = NULL;
+/* Number of entries in the block descriptor array. */
+static unsigned int nr_pages;
+
+/* Free blocks are kept in two sets of lists: clean blocks, all the pages of
+   which are known to be filled with zeros, and dirty blocks. */
+#define DIRTY 0
+#define CLEAN 1
+
+/* Lists of free blocks, indexed by cleanliness and order. */
+static struct block *free_area[2][NR_ORDERS];
+
+/* Bit n of free_area_map[i] is set if and only if free_area[i][n] is not
+   empty. */
+static unsigned long free_area_map[2] = { 0, 0 };
+
+/* Maximum number of shrinkers. */
+#define NR_PHYSMEM_SHRINKERS 4
+
+/* Functions called to release memory when an allocation fails. */
+static physmem_shrinker_t shrinkers[NR_PHYSMEM_SHRINKERS];
+static unsigned int nr_shrinkers = 0;
 
 /* Size of the physical memory. */
 size_t physmem_size;
 
+/* Physical memory statistics. */
+struct physmem_stats physmem_stats;
+
 /*
  * Returns the block descriptor corresponding to the specified address.
  * Note: There is no check on the validity of the specified address.
  */
 #define get_block_descriptor(addr) \
-    (first_block_descriptor + ((addr) >> PAGE_BIT_SHIFT));
+    (first_block_descriptor + ((addr) >> PAGE_BIT_SHIFT))
 
 /*
  * Returns the base address corresponding to the specified block descriptor.
  */
 #define get_block_descriptor_addr(b) \
-    (((b) - first_block_descriptor) << PAGE_BIT_SHIFT);
+    (((b) - first_block_descriptor) << PAGE_BIT_SHIFT)
+
+/*
+ * Same as above, using page frame numbers instead of addresses.
+ */
+#define get_page_descriptor(pfn) (first_block_descriptor + (pfn))
+#define get_page_number(b) ((b) - first_block_descriptor)
+
+/*
+ * Returns the set of lists the specified free block belongs to.
+ */
+#define get_block_list(b) ((b)->zeroed == (b)->pages ? CLEAN : DIRTY)
+
+/*
+ * Returns whether there is a free block of at least the specified order.
+ */
+#define has_free_block(order) \
+    ((free_area_map[DIRTY] | free_area_map[CLEAN]) & (~0UL << (order)))
+
+/*
+ * Returns the smallest order of a block containing at least the specified
+ * number of pages.
+ */
+static inline unsigned int get_order(size_t pages)
+{
+    return pages > 1 ? bsr(pages - 1) + 1 : 0;
+}
+
+/*
+ * Inserts the specified block in the free list corresponding to its order.
+ * The first zeroed pages of the block are known to be filled with zeros.
+ */
+static inline void add_free_block(struct block *b, unsigned int order,
+    unsigned int zeroed)
+{
+    unsigned int list;
+
+    b->available = TRUE;
+    b->order = order;
+    b->pages = 1 << order;
+    b->zeroed = zeroed;
+    list = get_block_list(b);
+    list_append(free_area[list][order], b);
+    free_area_map[list] |= 1 << order;
+    physmem_stats.clean_pages += zeroed;
+    physmem_stats.free_pages += 1 << order;
+}
+
+/*
+ * Removes the specified block from its free list. Its descriptor is left
+ * blank, except for its zeroed member, and it is up to the caller to fill
+ * it up if needed.
+ */
+static inline void remove_free_block(struct block *b)
+{
+    unsigned int list = get_block_list(b);
+
+    list_remove(free_area[list][b->order], b);
+    if (list_empty(free_area[list][b->order]))
+        free_area_map[list] &= ~(1 << b->order);
+    physmem_stats.clean_pages -= b->zeroed;
+    physmem_stats.free_pages -= 1 << b->order;
+    b->available = FALSE;
+    b->pages = 0;
+}
+
+/*
+ * Returns the free block containing the specified page, or NULL if that page
+ * is allocated. Since free blocks are aligned on their size, there are only
+ * NR_ORDERS candidates to look at.
+ */
+static struct block *find_free_block(unsigned int pfn)
+{
+    unsigned int order;
+    struct block *b;
+
+    for (order = 0; order < NR_ORDERS; order++) {
+        b = get_page_descriptor(pfn & (~0U << order));
+        if (b->available && b->order == order)
+            return b;
+    }
+
+    return NULL;
+}
+
+/*
+ * Gives the specified naturally aligned block back to the free lists, merging
+ * it with its buddy as many times as possible. The first zeroed pages of the
+ * block are known to be filled with zeros.
+ */
+static void free_buddy_block(unsigned int pfn, unsigned int order,
+    unsigned int zeroed)
+{
+    unsigned int buddy_pfn;
+    struct block *buddy;
+
+    get_page_descriptor(pfn)->available = FALSE;
+    get_page_descriptor(pfn)->pages = 0;
+
+    while (order < NR_ORDERS - 1) {
+        buddy_pfn = pfn ^ (1 << order);
+        if (buddy_pfn + (1 << order) > nr_pages)
+            break;
+        buddy = get_page_descriptor(buddy_pfn);
+        if (!buddy->available || buddy->order != order)
+            break;
+        /* Our buddy is free. Merge the two blocks. The zeroed pages of the
+           upper half only count if the lower half is entirely clean. */
+        remove_free_block(buddy);
+        if (buddy_pfn < pfn)
+            zeroed = buddy->zeroed == (1 << order) ?
+                buddy->zeroed + zeroed : buddy->zeroed;
+        else if (zeroed == (1 << order))
+            zeroed += buddy->zeroed;
+        pfn &= ~(1 << order);
+        order++;
+    }
+
+    add_free_block(get_page_descriptor(pfn), order, zeroed);
+}
+
+/*
+ * Gives an arbitrary range of pages back to the free lists, by splitting it
+ * into as few naturally aligned blocks as possible. The first zeroed pages
+ * of the range are known to be filled with zeros.
+ */
+static void free_page_range(unsigned int pfn, size_t pages, size_t zeroed)
+{
+    unsigned int order, n;
+
+    while (pages) {
+        order = pfn ? bsf(pfn) : NR_ORDERS - 1;
+        if (order > NR_ORDERS - 1)
+            order = NR_ORDERS - 1;
+        while ((1 << order) > pages)
+            order--;
+        n = zeroed < (1 << order) ? zeroed : (1 << order);
+        free_buddy_block(pfn, order, n);
+        zeroed -= n;
+        pfn += 1 << order;
+        pages -= 1 << order;
+    }
+}
+
+/*
+ * Returns whether all the pages in the range [pfn, end) are free. Note that
+ * the caller must make sure that pfn is the first page of a block.
+ */
+static bool_t free_range_available(unsigned int pfn, unsigned int end)
+{
+    struct block *h;
+
+    for (; pfn < end; pfn += 1 << h->order) {
+        if (pfn >= nr_pages)
+            return FALSE;
+        h = get_page_descriptor(pfn);
+        if (!h->available)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Returns the number of free pages immediately preceding the specified page,
+ * or at least max if there are more than that.
+ */
+static size_t free_pages_before(unsigned int pfn, size_t max)
+{
+    size_t count = 0;
+    struct block *h;
+
+    while (count < max && pfn && (h = find_free_block(pfn - 1))) {
+        count += pfn - get_page_number(h);
+        pfn = get_page_number(h);
+    }
+
+    return count;
+}
+
+/*
+ * Returns the number of free pages starting at the specified page, or at
+ * least max if there are more than that. Note that the caller must make
+ * sure that pfn is the first page of a block.
+ */
+static size_t free_pages_after(unsigned int pfn, size_t max)
+{
+    size_t count = 0;
+    struct block *h;
+
+    while (count < max && pfn < nr_pages
+        && (h = get_page_descriptor(pfn))->available) {
+        count += 1 << h->order;
+        pfn += 1 << h->order;
+    }
+
+    return count;
+}
+
+/*
+ * Takes all the pages in the range [start, end) out of the free lists. These
+ * pages must all be free. The parts of the free blocks overlapping the range
+ * that lie outside of it are given back to the free lists. If zero is TRUE,
+ * the pages in the range are filled with zeros, unless they are already
+ * clean. Hardware interrupts must be disabled.
+ */
+static void claim_free_range(unsigned int start, unsigned int end, bool_t zero)
+{
+    unsigned int pfn, first, last, size, zeroed;
+    struct block *h;
+
+    for (pfn = start; pfn < end; pfn = first + size) {
+        h = find_free_block(pfn);
+        first = get_page_number(h);
+        size = 1 << h->order;
+        zeroed = h->zeroed;
+        remove_free_block(h);
+
+        if (first < start)
+            free_page_range(first, start - first,
+                zeroed < start - first ? zeroed : start - first);
+
+        last = first + size < end ? first + size : end;
+        if (first + zeroed > pfn)
+            pfn = first + zeroed;
+        if (zero && pfn < last) {
+            memset((void *) (pfn << PAGE_BIT_SHIFT), 0,
+                (last - pfn) << PAGE_BIT_SHIFT);
+            physmem_stats.sync_zeroed_pages += last - pfn;
+        }
+
+        if (first + size > end)
+            free_page_range(end, first + size - end,
+                zeroed > end - first ? zeroed - (end - first) : 0);
+    }
+}
+
+/*
+ * Tries to widen the specified allocated block in place, using the free
+ * blocks that immediately follow it. If zero is TRUE, the pages added to
+ * the block are filled with zeros. Hardware interrupts must be disabled.
+ */
+static bool_t extend_block(struct block *b, size_t pages, bool_t zero)
+{
+    unsigned int start, end;
+
+    start = get_page_number(b) + b->pages;
+    end = get_page_number(b) + pages;
+
+    /* Note that the page following a block is always the first page of a
+       block, as required by free_range_available. */
+    if (!free_range_available(start, end))
+        return FALSE;
+
+    claim_free_range(start, end, zero);
+    b->pages = pages;
+    return TRUE;
+}
+
+/*
+ * Tries to widen the specified allocated block in place, using the free
+ * pages that surround it. The free pages following the block are used
+ * first. If some of the free pages preceding the block are needed, the
+ * content of the block is moved down, so the block descriptor changes.
+ * The pages added to the block are filled with zeros. Returns the new block
+ * descriptor, or NULL if the free pages around the block are not enough.
+ * Hardware interrupts must be disabled.
+ */
+static struct block *widen_block(struct block *b, size_t pages)
+{
+    unsigned int pfn;
+    size_t old_pages, needed, before, after;
+    struct block *h;
+
+    pfn = get_page_number(b);
+    old_pages = b->pages;
+    needed = pages - old_pages;
+
+    after = free_pages_after(pfn + old_pages, needed);
+    if (after > needed)
+        after = needed;
+    before = free_pages_before(pfn, needed - after);
+    if (before < needed - after)
+        return NULL;
+    before = needed - after;
+
+    claim_free_range(pfn + old_pages, pfn + old_pages + after, FALSE);
+    claim_free_range(pfn - before, pfn, FALSE);
+
+    /* Move the block descriptor... */
+    h = get_page_descriptor(pfn - before);
+    h->available = FALSE;
+    h->pages = pages;
+    h->mover = b->mover;
+    h->owner = b->owner;
+    b->pages = 0;
+    b->mover = NULL;
+
+    /* ...and the content of the block. The source and destination areas may
+       overlap. Everything past the old content must then be cleared. */
+    memmove((void *) get_block_descriptor_addr(h),
+        (void *) get_block_descriptor_addr(b), old_pages << PAGE_BIT_SHIFT);
+    memset((void *) (get_block_descriptor_addr(h) +
+        (old_pages << PAGE_BIT_SHIFT)), 0, needed << PAGE_BIT_SHIFT);
+
+    physmem_stats.realloc_moved_bytes += old_pages << PAGE_BIT_SHIFT;
+    physmem_stats.sync_zeroed_pages += needed;
+    return h;
+}
+
+/*
+ * Slow path of take_free_pages, used when no single free block is large
+ * enough to accommodate the specified number of pages: looks for a run of
+ * adjacent free blocks spanning enough pages. This is typically needed for
+ * requests larger than the largest naturally aligned hole in memory. Only
+ * the clean pages at the beginning of the first block of the run are
+ * accounted for in zeroed.
+ */
+static struct block *take_free_run(size_t pages, unsigned int *zeroed)
+{
+    int i;
+    unsigned int list, order, pfn;
+    struct block *b;
+
+    for (list = DIRTY; list <= CLEAN; list++) {
+        for (order = 0; order < NR_ORDERS; order++) {
+            list_for_each(free_area[list][order], b, i) {
+                pfn = get_page_number(b);
+                /* Only consider blocks that start a run of free blocks. */
+                if (pfn && find_free_block(pfn - 1))
+                    continue;
+                if (free_range_available(pfn, pfn + pages))
+                    goto found;
+            }
+        }
+    }
+
+    return NULL;
+
+found:
+
+    *zeroed = b->zeroed;
+    remove_free_block(b);
+    b->pages = 1 << order;
+    b->mover = NULL;
+    extend_block(b, pages, FALSE);
+    return b;
+}
+
+/*
+ * Takes the specified number of pages out of the smallest free block that
+ * is large enough. Requests for zeroed memory are served from clean blocks
+ * first, and other requests from dirty blocks first, so as not to waste the
+ * work of the idle task. The number of pages at the beginning of the block
+ * that are known to be filled with zeros is returned in zeroed. Hardware
+ * interrupts must be disabled.
+ */
+static struct block *take_free_pages(size_t pages, bool_t zero,
+    unsigned int *zeroed)
+{
+    unsigned int list, order, k, pfn, z;
+    unsigned long map = 0;
+    struct block *b;
+
+    order = get_order(pages);
+    if (order < NR_ORDERS) {
+        list = zero ? CLEAN : DIRTY;
+        map = free_area_map[list] & (~0UL << order);
+        if (!map) {
+            list = !list;
+            map = free_area_map[list] & (~0UL << order);
+        }
+    }
+
+    if (!map)
+        return take_free_run(pages, zeroed);
+
+    k = bsf(map);
+    b = free_area[list][k];
+    z = b->zeroed;
+    remove_free_block(b);
+    pfn = get_page_number(b);
+
+    /* Split the block until it has the right order. The upper half gets
+       whatever clean pages extend past the lower half. */
+    while (k > order) {
+        k--;
+        add_free_block(get_page_descriptor(pfn + (1 << k)), k,
+            z > (1 << k) ? z - (1 << k) : 0);
+        if (z > (1 << k))
+            z = 1 << k;
+    }
+
+    /* Give the unused tail of the block back to the free lists. */
+    if (pages < (1 << order))
+        free_page_range(pfn + pages, (1 << order) - pages,
+            z > pages ? z - pages : 0);
+
+    b->pages = pages;
+    b->mover = NULL;
+    *zeroed = z < pages ? z : pages;
+    return b;
+}
+
+/*
+ * Moves the specified allocated block down to the specified page. All the
+ * pages between that page and the block must be free. The mover of the block
+ * is called first, and may veto the move, in which case NULL is returned.
+ * Otherwise, the new block descriptor is returned. Hardware interrupts must
+ * be disabled.
+ */
+static struct block *move_block_down(struct block *b, unsigned int pfn)
+{
+    unsigned int old_pfn, end;
+    size_t pages;
+    struct block *h;
+
+    if (!b->mover || !b->mover(b->owner, pfn << PAGE_BIT_SHIFT))
+        return NULL;
+
+    old_pfn = get_page_number(b);
+    pages = b->pages;
+
+    /* Only the part of the hole that does not overlap the old location of the
+       block needs to be claimed, and only the part of the old location that
+       does not overlap the new one needs to be freed. */
+    end = pfn + pages < old_pfn ? pfn + pages : old_pfn;
+    claim_free_range(pfn, end, FALSE);
+
+    h = get_page_descriptor(pfn);
+    h->available = FALSE;
+    h->pages = pages;
+    h->mover = b->mover;
+    h->owner = b->owner;
+    b->pages = 0;
+    b->mover = NULL;
+
+    memmove((void *) get_block_descriptor_addr(h),
+        (void *) get_block_descriptor_addr(b), pages << PAGE_BIT_SHIFT);
+
+    end = pfn + pages > old_pfn ? pfn + pages : old_pfn;
+    free_page_range(end, old_pfn + pages - end, 0);
+
+    physmem_stats.compaction_moved_bytes += pages << PAGE_BIT_SHIFT;
+    return h;
+}
+
+/*
+ * Returns the number of pages in the largest run of free pages. Hardware
+ * interrupts must be disabled.
+ */
+static size_t largest_free_run(void)
+{
+    unsigned int pfn;
+    size_t run = 0, largest = 0;
+    struct block *b;
+
+    for (pfn = 0; pfn < nr_pages; ) {
+        b = get_page_descriptor(pfn);
+        if (b->available) {
+            run += 1 << b->order;
+            pfn += 1 << b->order;
+        } else {
+            run = 0;
+            pfn += b->pages;
+        }
+        if (run > largest)
+            largest = run;
+    }
+
+    return largest;
+}
+
+/*
+ * Calls all the registered shrinkers, with hardware interrupts disabled.
+ * Returns the number of pages they have released.
+ */
+static size_t shrink_physmem(void)
+{
+    unsigned int i;
+    size_t pages = 0;
+    unsigned long eflags;
+
+    disable_hwint(eflags);
+
+    for (i = 0; i < nr_shrinkers; i++)
+        pages += shrinkers[i]();
+
+    physmem_stats.shrinker_runs++;
+    physmem_stats.shrunk_pages += pages;
+
+    restore_hwint(eflags);
+    return pages;
+}
+
+/*
+ * Allocates a block of physical memory. This is the common part of
+ * __alloc_physmem_block and alloc_physmem_block. The number of pages
+ * at the beginning of the block that are known to be filled with zeros
+ * is returned in zeroed.
+ */
+static ret_t alloc_pages(size_t pages, bool_t zero, addr_t *paddr,
+    unsigned int *zeroed)
+{
+    struct block *b;
+    unsigned long eflags;
+
+    if (!pages || !paddr)
+        return -E_INVALIDARG;
+
+    disable_hwint(eflags);
+
+    b = take_free_pages(pages, zero, zeroed);
+    if (!b) {
+        /* Try to make a big enough hole. This is done with hardware
+           interrupts enabled (unless they were disabled by our caller) so
+           that they get serviced between the blocks compaction moves. The
+           hole may then be taken before we get to it, so look again. */
+        restore_hwint(eflags);
+        if (compact_physmem(pages) < pages && shrink_physmem())
+            compact_physmem(pages);
+        disable_hwint(eflags);
+        b = take_free_pages(pages, zero, zeroed);
+    }
+    if (!b) {
+        /* No big enough hole was found to fit the specified number of
+           pages. */
+        restore_hwint(eflags);
+        return -E_NOMEM;
+    }
+
+    if (zero) {
+        physmem_stats.zeroed_allocs++;
+        if (*zeroed == pages)
+            physmem_stats.clean_hits++;
+        physmem_stats.sync_zeroed_pages += pages - *zeroed;
+    }
+
+    *paddr = get_block_descriptor_addr(b);
+    restore_hwint(eflags);
+    return S_OK;
+}
 
 /*
  * Initializes the physical memory management module using the specified
@@ -102,9 +707,11 @@ void init_physmem(size_t memsize)
     /* Are we going to store the array of physical memory block descriptors in
        conventional memory or in extended memory? */
 
-    if (count * sizeof(struct block) <= BIOS_AND_VIDEO_MEMORY_START - (addr_t) &__e_kernel) {
+    if (count * sizeof(struct block) <=
+        BIOS_AND_VIDEO_MEMORY_START - (addr_t) &__e_kernel) {
         first_block_descriptor = (struct block *) &__e_kernel;
-    } else if (count * sizeof(struct block) <= memsize - BIOS_AND_VIDEO_MEMORY_END) {
+    } else if (count * sizeof(struct block) <=
+               memsize - BIOS_AND_VIDEO_MEMORY_END) {
         first_block_descriptor = (struct block *) BIOS_AND_VIDEO_MEMORY_END;
         use_low_mem = FALSE;
     } else {
@@ -113,24 +720,37 @@ void init_physmem(size_t memsize)
 
     descriptor_array_end_addr = (addr_t) (first_block_descriptor + count);
 
-    /* Initialize the list of blocks in physical memory. */
+    /* All the pages start out blank. */
+    nr_pages = count;
+    memset(first_block_descriptor, 0, count * sizeof(struct block));
 
-    #define add_block(start_addr, end_addr, is_hole)           \
-        b = get_block_descriptor(PAGE_ALIGN_INF(start_addr));  \
-        b->pages = (PAGE_ALIGN_SUP(end_addr) -                 \
-            PAGE_ALIGN_INF(start_addr)) >> PAGE_BIT_SHIFT;     \
-        b->available = (is_hole);                              \
-        list_append(block_list_head, b);
+    /* Initialize the blocks in physical memory. Allocated blocks are rounded
+       up to a whole number of pages, and holes are rounded down. */
+
+    #define add_block(start_addr, end_addr, is_hole)                          \
+        if (is_hole) {                                                        \
+            free_page_range(PAGE_ALIGN_SUP(start_addr) >> PAGE_BIT_SHIFT,     \
+                (PAGE_ALIGN_INF(end_addr) - PAGE_ALIGN_SUP(start_addr))       \
+                >> PAGE_BIT_SHIFT, 0);                                        \
+        } else {                                                              \
+            b = get_block_descriptor(PAGE_ALIGN_INF(start_addr));             \
+            b->pages = (PAGE_ALIGN_SUP(end_addr) -                            \
+                PAGE_ALIGN_INF(start_addr)) >> PAGE_BIT_SHIFT;                \
+            b->available = FALSE;                                             \
+        }
 
     if (use_low_mem) {
         add_block(0, descriptor_array_end_addr, FALSE);
-        add_block(descriptor_array_end_addr, BIOS_AND_VIDEO_MEMORY_START, TRUE);
-        add_block(BIOS_AND_VIDEO_MEMORY_START, BIOS_AND_VIDEO_MEMORY_END, FALSE);
+        add_block(descriptor_array_end_addr, BIOS_AND_VIDEO_MEMORY_START,
+            TRUE);
+        add_block(BIOS_AND_VIDEO_MEMORY_START, BIOS_AND_VIDEO_MEMORY_END,
+            FALSE);
         add_block(BIOS_AND_VIDEO_MEMORY_END, memsize, TRUE);
     } else {
         add_block(0, (addr_t) &__e_kernel, FALSE);
         add_block((addr_t) &__e_kernel, BIOS_AND_VIDEO_MEMORY_START, TRUE);
-        add_block(BIOS_AND_VIDEO_MEMORY_START, descriptor_array_end_addr, FALSE);
+        add_block(BIOS_AND_VIDEO_MEMORY_START, descriptor_array_end_addr,
+            FALSE);
         add_block(descriptor_array_end_addr, memsize, TRUE);
     }
 }
@@ -141,56 +761,77 @@ void init_physmem(size_t memsize)
  */
 ret_t __alloc_physmem_block(size_t pages, addr_t *paddr)
 {
-    int i;
-    addr_t addr;
-    struct block *b, *h;
-    unsigned long eflags;
+    unsigned int zeroed;
 
-    if (!pages || !paddr)
-        return -E_INVALIDARG;
+    return alloc_pages(pages, FALSE, paddr, &zeroed);
+}
 
-    disable_hwint(eflags);
+/*
+ * Allocates a block of physical memory containing the specified number of
+ * pages. Returns the base address of the newly allocated block in the
+ * specified paddr parameter. This address is aligned on a page. The
+ * allocated block of memory is filled with zeros.
+ */
+ret_t alloc_physmem_block(size_t pages, addr_t *paddr)
+{
+    unsigned int zeroed;
+    ret_t res = alloc_pages(pages, TRUE, paddr, &zeroed);
 
-    /* Find a hole big enough to accomodate the specified number of pages
-       using the first-fit algorithm. */
-    list_for_each(block_list_head, b, i)
-        if (b->available && b->pages >= pages)
-            goto found;
+    /* Only the pages that were not already clean need to be zeroed. */
+    if (res == S_OK && zeroed < pages)
+        memset((void *) (*paddr + (zeroed << PAGE_BIT_SHIFT)), 0,
+            (pages - zeroed) << PAGE_BIT_SHIFT);
+    return res;
+}
 
-    /* No big enough hole was found to fit the specified number of pages. */
-    restore_hwint(eflags);
-    return -E_NOMEM;
+/*
+ * Allocates a block of physical memory spanning exactly 1 << order pages and
+ * aligned on a multiple of its size, so that the base address of the block
+ * can be found by masking any address within it. Returns the base address of
+ * the newly allocated block in the specified paddr parameter. The allocated
+ * block of memory is not filled with zeros, and must not be resized.
+ */
+ret_t alloc_physmem_aligned_block(unsigned int order, addr_t *paddr)
+{
+    struct block *b;
+    unsigned int zeroed;
+    unsigned long eflags;
 
-found:
+    if (order >= NR_ORDERS || !paddr)
+        return -E_INVALIDARG;
 
-    b->available = FALSE;
-    addr = get_block_descriptor_addr(b);
-    if (b->pages > pages) {
-        /* A new hole has to be inserted after this block. */
-        h = get_block_descriptor(addr + (pages << PAGE_BIT_SHIFT));
-        h->available = TRUE;
-        h->pages = b->pages - pages;
-        b->pages = pages;
-        list_insert_after(b, h);
+    disable_hwint(eflags);
+
+    /* Only the blocks in the free lists are naturally aligned, so the runs
+       of free blocks take_free_pages may fall back to cannot be used. As in
+       alloc_pages, compaction and shrinking are done with hardware
+       interrupts enabled, and the free lists are looked at again after. */
+    if (!has_free_block(order)) {
+        restore_hwint(eflags);
+        compact_physmem(1 << order);
+        if (!has_free_block(order) && shrink_physmem())
+            compact_physmem(1 << order);
+        disable_hwint(eflags);
+    }
+    if (!has_free_block(order)) {
+        restore_hwint(eflags);
+        return -E_NOMEM;
     }
 
-    *paddr = addr;
+    b = take_free_pages(1 << order, FALSE, &zeroed);
+    *paddr = get_block_descriptor_addr(b);
     restore_hwint(eflags);
     return S_OK;
 }
 
 /*
- * Allocates a block of physical memory containing the specified number of
- * pages. Returns the base address of the newly allocated block in the
- * specified paddr parameter. This address is aligned on a page. The
- * allocated block of memory is filled with zeros.
+ * Returns whether alloc_physmem_aligned_block can allocate a block of the
+ * specified order right away, i.e. without compacting physical memory or
+ * calling the shrinkers.
  */
-ret_t alloc_physmem_block(size_t pages, addr_t *paddr)
+bool_t has_free_physmem_block(unsigned int order)
 {
-    ret_t res = __alloc_physmem_block(pages, paddr);
-    if (res == S_OK)
-        memset((void *) *paddr, 0, pages << PAGE_BIT_SHIFT);
-    return res;
+    return order < NR_ORDERS && has_free_block(order);
 }
 
 /*
@@ -201,35 +842,39 @@ ret_t free_physmem_block(addr_t addr)
     struct block *b;
     unsigned long eflags;
 
-    if (addr >= physmem_size - PAGE_SIZE)
+    if (addr >= physmem_size)
         panic("Trying to free an invalid block of physical memory");
 
     disable_hwint(eflags);
 
     b = get_block_descriptor(addr);
-    if (b->available) {
+    if (b->available || !b->pages) {
         restore_hwint(eflags);
         return -E_FAIL;
     }
 
-    b->available = TRUE;
-
-    if (b < b->next && b->next->available) {
-        /* This hole is followed by another hole. Merge the two holes. */
-        b->pages += b->next->pages;
-        list_remove(block_list_head, b->next);
-    }
-
-    if (b->prev < b && b->prev->available) {
-        /* This hole is preceded by another hole. Merge the two holes. */
-        b->prev->pages += b->pages;
-        list_remove(block_list_head, b);
-    }
+    b->mover = NULL;
+    free_page_range(addr >> PAGE_BIT_SHIFT, b->pages, 0);
 
     restore_hwint(eflags);
     return S_OK;
 }
 
+/*
+ * Returns the number of pages in the allocated block of physical memory
+ * starting at the specified address, or 0 if there is no such block.
+ */
+size_t get_physmem_block_size(addr_t addr)
+{
+    struct block *b;
+
+    if (addr >= physmem_size)
+        return 0;
+
+    b = get_block_descriptor(addr);
+    return b->available ? 0 : b->pages;
+}
+
 /*
  * Changes the size of the block of physical memory starting at address addr to
  * pages physical memory pages. The block may need to be relocated, and the new
@@ -238,8 +883,10 @@ ret_t free_physmem_block(addr_t addr)
  */
 ret_t realloc_physmem_block(addr_t addr, size_t pages, addr_t *paddr)
 {
-    ret_t res;
+    size_t old_pages;
+    unsigned int zeroed;
     struct block *b, *h;
+    physmem_mover_t mover;
     unsigned long eflags;
 
     if (!pages || !paddr)
@@ -248,85 +895,296 @@ ret_t realloc_physmem_block(addr_t addr, size_t pages, addr_t *paddr)
     disable_hwint(eflags);
 
     b = get_block_descriptor(addr);
-    if (b->available) {
+    if (b->available || !b->pages) {
         restore_hwint(eflags);
         return -E_FAIL;
     }
 
-    if (pages == b->pages) {
+    old_pages = b->pages;
+
+    if (pages == old_pages) {
 
         /* No change needed. */
         *paddr = addr;
-        restore_hwint(eflags);
-        return S_OK;
 
-    } else if (pages < b->pages) {
+    } else if (pages < old_pages) {
 
-        /* Shrink the block. This is always a cheap operation. */
+        /* Shrink the block. This is always a cheap operation. If everybody
+           else does their job right, it should be safe not to erase the
+           content of the deallocated memory. */
+        free_page_range((addr >> PAGE_BIT_SHIFT) + pages, old_pages - pages,
+            0);
+        b->pages = pages;
+        *paddr = addr;
 
-        if (b < b->next && b->next->available) {
-            /* This block is followed by a hole. Widen the following hole. */
-            h = get_block_descriptor(addr + (pages << PAGE_BIT_SHIFT));
-            h->available = TRUE;
-            h->pages = b->next->pages + b->pages - pages;
-            list_replace(block_list_head, b->next, h);
-        } else {
-            /* Either this block was the last block in memory, or it is followed
-               by an allocated block. Insert a new hole right after it. */
-            h = get_block_descriptor(addr + (pages << PAGE_BIT_SHIFT));
-            h->available = TRUE;
-            h->pages = b->pages - pages;
-            list_insert_after(b, h);
-        }
+    } else if (extend_block(b, pages, TRUE)) {
 
-        /* Shrink the block. If everybody else does their job right, it should
-           be safe not to erase the content of the deallocated memory. */
-        b->pages = pages;
+        /* The block was followed by enough free pages to be widened. */
+        physmem_stats.realloc_avoided_bytes += old_pages << PAGE_BIT_SHIFT;
         *paddr = addr;
 
+    } else if ((h = widen_block(b, pages))) {
+
+        /* The block was surrounded by enough free pages to be widened. Its
+           content had to be moved down, but at least we did not need to
+           find a completely separate hole. */
+        *paddr = get_block_descriptor_addr(h);
+
     } else {
 
-        /* Widen the block. */
+        /* The block needs to be reallocated. This is expensive. If there is
+           no hole large enough, try to make one, taking care not to move
+           the block we are working on. */
+        h = take_free_pages(pages, TRUE, &zeroed);
+        if (!h) {
+            mover = b->mover;
+            b->mover = NULL;
+            if (compact_physmem(pages) >= pages)
+                h = take_free_pages(pages, TRUE, &zeroed);
+            b->mover = mover;
+        }
+        if (!h) {
+            restore_hwint(eflags);
+            return -E_NOMEM;
+        }
+        h->mover = b->mover;
+        h->owner = b->owner;
+        b->mover = NULL;
+        *paddr = get_block_descriptor_addr(h);
+        /* Copy the old data into the newly allocated block. */
+        memcpy((void *) *paddr, (void *) addr, old_pages << PAGE_BIT_SHIFT);
+        physmem_stats.realloc_copied_bytes += old_pages << PAGE_BIT_SHIFT;
+        /* Fill the remaining memory area with zeros, unless it is clean. */
+        if (zeroed < old_pages)
+            zeroed = old_pages;
+        if (zeroed < pages) {
+            memset((void *) (*paddr + (zeroed << PAGE_BIT_SHIFT)), 0,
+                (pages - zeroed) << PAGE_BIT_SHIFT);
+            physmem_stats.sync_zeroed_pages += pages - zeroed;
+        }
+        /* And free the old block. */
+        free_page_range(addr >> PAGE_BIT_SHIFT, old_pages, 0);
 
-        if (b < b->next && b->next->available && b->next->pages >= pages - b->pages) {
-            /* This block is followed by a hole wide enough. */
+    }
 
-            if (b->next->pages > pages - b->pages) {
-                /* Shrink the following hole. */
-                h = get_block_descriptor(addr + (pages << PAGE_BIT_SHIFT));
-                h->available = TRUE;
-                h->pages = b->next->pages - pages + b->pages;
-                list_replace(block_list_head, b->next, h);
-            } else {
-                /* Remove the following hole. */
-                list_remove(block_list_head, h);
-            }
+    restore_hwint(eflags);
+    return S_OK;
+}
+
+/*
+ * Fills one page of free memory with zeros. The pages of the smallest dirty
+ * free block are zeroed first, since small blocks are the most frequently
+ * allocated. Returns FALSE if there are no dirty free pages left. This is
+ * called by the idle task with hardware interrupts enabled. They are only
+ * disabled while a single page is being zeroed, so the block cannot be
+ * allocated from under us, and the interrupt latency remains low.
+ */
+bool_t zero_free_page(void)
+{
+    unsigned int order;
+    struct block *b;
+    unsigned long eflags;
+
+    disable_hwint(eflags);
+
+    if (!free_area_map[DIRTY]) {
+        restore_hwint(eflags);
+        return FALSE;
+    }
 
-            /* Widen the block. */
-            b->pages = pages;
-            *paddr = addr;
+    order = bsf(free_area_map[DIRTY]);
+    b = free_area[DIRTY][order];
 
-        } else {
+    memset((void *) (get_block_descriptor_addr(b) +
+        (b->zeroed << PAGE_BIT_SHIFT)), 0, PAGE_SIZE);
+    physmem_stats.idle_zeroed_pages++;
+
+    if (b->zeroed + 1 < b->pages) {
+        b->zeroed++;
+        physmem_stats.clean_pages++;
+    } else {
+        /* The block is now entirely clean. Move it to the right list. */
+        remove_free_block(b);
+        add_free_block(b, order, 1 << order);
+    }
+
+    restore_hwint(eflags);
+    return TRUE;
+}
+
+/*
+ * Declares the allocated block of physical memory starting at the specified
+ * address as movable. Before moving the block, the specified mover function
+ * is called with hardware interrupts disabled, and passed the specified owner
+ * along with the new address of the block. It must update all the references
+ * to the block, and return TRUE, or return FALSE to veto the move (e.g. if the
+ * block is in use at that time) The content of the block is copied once the
+ * mover has returned. Passing a NULL mover makes the block immovable again.
+ * The mover of a block follows it when the block gets reallocated, and gets
+ * forgotten when the block is freed.
+ */
+ret_t set_physmem_block_mover(addr_t addr, physmem_mover_t mover, void *owner)
+{
+    struct block *b;
+    unsigned long eflags;
 
-            /* The block needs to be reallocated. This is expensive. */
-            res = __alloc_physmem_block(pages, paddr);
-            if (res != S_OK) {
-                restore_hwint(eflags);
-                return res;
+    if (addr >= physmem_size)
+        return -E_INVALIDARG;
+
+    disable_hwint(eflags);
+
+    b = get_block_descriptor(addr);
+    if (b->available || !b->pages) {
+        restore_hwint(eflags);
+        return -E_FAIL;
+    }
+
+    b->mover = mover;
+    b->owner = owner;
+
+    restore_hwint(eflags);
+    return S_OK;
+}
+
+/*
+ * Registers a function that gets called when an allocation is about to fail
+ * for lack of memory, even after compaction. The shrinker must give back as
+ * much memory as it can spare, and return the number of pages it released.
+ * It is called with hardware interrupts disabled, and must not allocate
+ * memory.
+ */
+ret_t register_physmem_shrinker(physmem_shrinker_t shrinker)
+{
+    unsigned long eflags;
+
+    disable_hwint(eflags);
+
+    if (nr_shrinkers == NR_PHYSMEM_SHRINKERS) {
+        restore_hwint(eflags);
+        return -E_NOMEM;
+    }
+
+    shrinkers[nr_shrinkers++] = shrinker;
+    restore_hwint(eflags);
+    return S_OK;
+}
+
+/*
+ * Returns the number of pages in the largest run of free pages, and updates
+ * the corresponding statistic.
+ */
+size_t get_physmem_largest_hole(void)
+{
+    size_t largest;
+    unsigned long eflags;
+
+    disable_hwint(eflags);
+    largest = largest_free_run();
+    physmem_stats.largest_hole = largest;
+    restore_hwint(eflags);
+
+    return largest;
+}
+
+/*
+ * Returns whether the specified page is the first page of a block, free or
+ * allocated. Hardware interrupts must be disabled.
+ */
+static bool_t is_block_start(unsigned int pfn)
+{
+    struct block *b = get_page_descriptor(pfn);
+    return b->available || b->pages;
+}
+
+/*
+ * Slides the movable blocks of physical memory toward low memory, so that
+ * the holes between them coalesce. If pages is not 0, stops as soon as a
+ * run of at least that many free pages has been created. Returns the number
+ * of pages in the largest run of free pages.
+ *
+ * Hardware interrupts are only disabled while a single block is being moved,
+ * so that a long pass does not delay interrupts. In between, blocks may be
+ * allocated or freed, so the position we were at and the hole we were
+ * filling are checked again before going on: if the former is not the first
+ * page of a block anymore, we skip to the next one, and if the latter is not
+ * entirely free anymore, we give up on it. Note that when called with
+ * hardware interrupts disabled (from an interrupt handler, or from
+ * realloc_physmem_block, which must keep the block it resizes in place) the
+ * whole pass is still done in one go.
+ */
+size_t compact_physmem(size_t pages)
+{
+    unsigned int pfn = 0, hole = 0;
+    bool_t in_hole = FALSE, done = FALSE;
+    size_t largest;
+    struct block *b, *h;
+    unsigned long eflags;
+
+    disable_hwint(eflags);
+    physmem_stats.compaction_runs++;
+    restore_hwint(eflags);
+
+    while (!done) {
+
+        disable_hwint(eflags);
+
+        /* Blocks may have been allocated or freed while interrupts were
+           enabled. The descriptors of the pages following the first one of
+           a block are blank, so the next block is easy to find. Note that
+           the pages right after the block we just moved may have been
+           allocated, in which case the hole is now empty. */
+        while (pfn < nr_pages && !is_block_start(pfn))
+            pfn++;
+        if (in_hole && (hole == pfn ||
+            free_pages_before(pfn, pfn - hole) < pfn - hole))
+            in_hole = FALSE;
+
+        /* Skip the free pages up to the next allocated block, remembering
+           where this run of free pages started. */
+        while (pfn < nr_pages && (b = get_page_descriptor(pfn))->available) {
+            if (!in_hole) {
+                hole = pfn;
+                in_hole = TRUE;
             }
-            /* Copy the old data into the newly allocated block. */
-            memcpy((void *) *paddr, (void *) addr, b->pages << PAGE_BIT_SHIFT);
-            /* Fill the remaining memory area with zeros. */
-            memset((void *) (*paddr + (b->pages << PAGE_BIT_SHIFT)), 0,
-                (pages - b->pages) << PAGE_BIT_SHIFT);
-            /* And free the old block. */
-            res = free_physmem_block(addr);
-            ASSERT(res == S_OK);
+            pfn += 1 << b->order;
+        }
 
+        if (pfn >= nr_pages) {
+            done = TRUE;
+        } else if (in_hole && (h = move_block_down(b, hole))) {
+            /* The hole now starts right after the block we just moved. */
+            hole = pfn = hole + h->pages;
+            if (pages && free_pages_after(pfn, pages) >= pages)
+                done = TRUE;
+        } else {
+            in_hole = FALSE;
+            pfn += b->pages;
         }
 
+        restore_hwint(eflags);
     }
 
+    disable_hwint(eflags);
+    largest = largest_free_run();
+    physmem_stats.largest_hole = largest;
     restore_hwint(eflags);
-    return S_OK;
+
+    return largest;
+}
+
+/*
+ * This kernel thread periodically checks how fragmented physical memory is,
+ * and compacts it when the largest hole gets much smaller than the total
+ * amount of free memory (see COMPACTION_INTERVAL and COMPACTION_THRESHOLD)
+ */
+void compaction_task(void)
+{
+    size_t largest;
+
+    for (;;) {
+        do_sleep(COMPACTION_INTERVAL);
+        largest = get_physmem_largest_hole();
+        if (largest * 100 < physmem_stats.free_pages * COMPACTION_THRESHOLD)
+            compact_physmem(0);
+    }
 }
@@ -0,0 +1,287 @@
+/*===========================================================================
+ *
+ * rbtree.c
+ *
+ * Copyright (C) 2007 - Julien Lecomte
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ *===========================================================================
+ *
+ * Red-black trees. A red-black tree is a binary search tree, the nodes of
+ * which are either red or black, such that:
+ *
+ *   - The root is black.
+ *   - A red node does not have a red child.
+ *   - All the paths from a node down to its leaves go through the same
+ *     number of black nodes.
+ *
+ * This guarantees that the longest path from the root to a leaf is at most
+ * twice as long as the shortest one, so lookups, insertions and removals
+ * all take O(log n) time. The rebalancing code follows Introduction to
+ * Algorithms (Cormen, Leiserson, Rivest & Stein), chapter 13, with NULL
+ * leaves instead of a sentinel node.
+ *
+ *===========================================================================*/
+
+#include <simplix/proto.h>
+#include <simplix/rbtree.h>
+#include <simplix/types.h>
+
+#define is_red(node)   ((node) && (node)->color == RB_RED)
+#define is_black(node) (!is_red(node))
+
+/*
+ * Replaces the specified node by the specified new node (which may be NULL)
+ * in the link from its parent.
+ */
+static inline void replace_child(struct rb_root *root, struct rb_node *node,
+    struct rb_node *new)
+{
+    if (!node->parent)
+        root->node = new;
+    else if (node == node->parent->left)
+        node->parent->left = new;
+    else
+        node->parent->right = new;
+    if (new)
+        new->parent = node->parent;
+}
+
+/*
+ * Makes the right child of the specified node take its place, and the node
+ * become the left child of its former right child.
+ */
+static void rotate_left(struct rb_root *root, struct rb_node *node)
+{
+    struct rb_node *right = node->right;
+
+    node->right = right->left;
+    if (right->left)
+        right->left->parent = node;
+    replace_child(root, node, right);
+    right->left = node;
+    node->parent = right;
+}
+
+/*
+ * Makes the left child of the specified node take its place, and the node
+ * become the right child of its former left child.
+ */
+static void rotate_right(struct rb_root *root, struct rb_node *node)
+{
+    struct rb_node *left = node->left;
+
+    node->left = left->right;
+    if (left->right)
+        left->right->parent = node;
+    replace_child(root, node, left);
+    left->right = node;
+    node->parent = left;
+}
+
+/*
+ * Rebalances the specified tree after the specified node was linked to it
+ * (see rb_link_node)
+ */
+void rb_insert_color(struct rb_node *node, struct rb_root *root)
+{
+    struct rb_node *parent, *gparent, *uncle;
+
+    while (is_red(node->parent)) {
+        parent = node->parent;
+        gparent = parent->parent;
+
+        if (parent == gparent->left) {
+            uncle = gparent->right;
+            if (is_red(uncle)) {
+                parent->color = uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->right) {
+                rotate_left(root, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rotate_right(root, gparent);
+        } else {
+            uncle = gparent->left;
+            if (is_red(uncle)) {
+                parent->color = uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->left) {
+                rotate_right(root, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rotate_left(root, gparent);
+        }
+    }
+
+    root->node->color = RB_BLACK;
+}
+
+/*
+ * Restores the properties of the specified tree after a black node was
+ * removed from below the specified parent, on the side of the specified
+ * node (which may be NULL)
+ */
+static void erase_color(struct rb_root *root, struct rb_node *node,
+    struct rb_node *parent)
+{
+    struct rb_node *sibling;
+
+    while (node != root->node && is_black(node)) {
+        if (node == parent->left) {
+            sibling = parent->right;
+            if (is_red(sibling)) {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rotate_left(root, parent);
+                sibling = parent->right;
+            }
+            if (is_black(sibling->left) && is_black(sibling->right)) {
+                sibling->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (is_black(sibling->right)) {
+                sibling->left->color = RB_BLACK;
+                sibling->color = RB_RED;
+                rotate_right(root, sibling);
+                sibling = parent->right;
+            }
+            sibling->color = parent->color;
+            parent->color = RB_BLACK;
+            sibling->right->color = RB_BLACK;
+            rotate_left(root, parent);
+        } else {
+            sibling = parent->left;
+            if (is_red(sibling)) {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rotate_right(root, parent);
+                sibling = parent->left;
+            }
+            if (is_black(sibling->left) && is_black(sibling->right)) {
+                sibling->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (is_black(sibling->left)) {
+                sibling->right->color = RB_BLACK;
+                sibling->color = RB_RED;
+                rotate_left(root, sibling);
+                sibling = parent->left;
+            }
+            sibling->color = parent->color;
+            parent->color = RB_BLACK;
+            sibling->left->color = RB_BLACK;
+            rotate_right(root, parent);
+        }
+        node = root->node;
+        break;
+    }
+
+    if (node)
+        node->color = RB_BLACK;
+}
+
+/*
+ * Removes the specified node from the specified tree.
+ */
+void rb_erase(struct rb_node *node, struct rb_root *root)
+{
+    struct rb_node *child, *parent, *next;
+    int color;
+
+    if (!node->left || !node->right) {
+        /* The node has at most one child, which takes its place. */
+        child = node->left ? node->left : node->right;
+        parent = node->parent;
+        color = node->color;
+        replace_child(root, node, child);
+    } else {
+        /* The node has two children. Its successor, which has no left
+           child, takes its place, and the right child of the successor
+           takes the place of the successor. */
+        next = node->right;
+        while (next->left)
+            next = next->left;
+        child = next->right;
+        color = next->color;
+
+        if (next->parent == node) {
+            parent = next;
+        } else {
+            parent = next->parent;
+            replace_child(root, next, child);
+            next->right = node->right;
+            next->right->parent = next;
+        }
+
+        replace_child(root, node, next);
+        next->left = node->left;
+        next->left->parent = next;
+        next->color = node->color;
+    }
+
+    if (color == RB_BLACK)
+        erase_color(root, child, parent);
+}
+
+/*
+ * Returns the first node of the specified tree, or NULL if it is empty.
+ */
+struct rb_node *rb_first(const struct rb_root *root)
+{
+    struct rb_node *node = root->node;
+
+    if (node)
+        while (node->left)
+            node = node->left;
+
+    return node;
+}
+
+/*
+ * Returns the node following the specified node in its tree, or NULL if it
+ * is the last one.
+ */
+struct rb_node *rb_next(const struct rb_node *node)
+{
+    if (node->right) {
+        node = node->right;
+        while (node->left)
+            node = node->left;
+        return (struct rb_node *) node;
+    }
+
+    while (node->parent && node == node->parent->right)
+        node = node->parent;
+
+    return node->parent;
+}
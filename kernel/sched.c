@@ -28,8 +28,11 @@
 #include <simplix/consts.h>
 #include <simplix/globals.h>
 #include <simplix/list.h>
+#include <simplix/macros.h>
 #include <simplix/proto.h>
+#include <simplix/rbtree.h>
 #include <simplix/segment.h>
+#include <simplix/stats.h>
 #include <simplix/task.h>
 #include <simplix/tss.h>
 #include <simplix/types.h>
@@ -43,37 +46,290 @@ struct task_struct *current = NULL;
 /* The idle task. */
 struct task_struct *idle_task = NULL;
 
+/* Whether the current task should give the CPU away as soon as possible. */
+bool_t need_resched = FALSE;
+
+/* The task whose LDT and kernel-space stack are currently set up. */
+struct task_struct *ldt_owner = NULL;
+
+/* Kernel information segment (see kinfo.h) */
+struct kinfo kinfo;
+
+/* Scheduler statistics. */
+struct sched_stats sched_stats;
+
+/*
+ * Weight of a task at each nice level, from NICE_MIN to NICE_MAX. A task
+ * gets a share of the CPU proportional to its weight. Each nice level is
+ * worth about 10% of CPU time relative to a task one level apart, so the
+ * weights are about 1.25 times apart. These are the values used by Linux.
+ */
+#define NICE_0_WEIGHT 1024
+
+static const unsigned long nice_to_weight[NICE_MAX - NICE_MIN + 1] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */  9548,  7620,  6100,  4904,  3906,
+    /*  -5 */  3121,  2501,  1991,  1586,  1277,
+    /*   0 */  1024,   820,   655,   526,   423,
+    /*   5 */   335,   272,   215,   172,   137,
+    /*  10 */   110,    87,    70,    56,    45,
+    /*  15 */    36,    29,    23,    18,    15,
+};
+
+/* Virtual run time charged to a task of nice 0 for every tick it runs. A
+   task of weight w is charged NICE_0_VSLICE * NICE_0_WEIGHT / w instead. */
+#define NICE_0_VSLICE 1024
+
+/* A task that wakes up is placed at most SLEEPER_CREDIT behind the runnable
+   task that has run the least, so that sleeping does not let it accrue an
+   unbounded amount of CPU time, while still favoring interactive tasks. */
+#define SLEEPER_CREDIT (SCHED_TICKS * NICE_0_VSLICE / 2)
+
+/* A task that wakes up only preempts the current task if the current task
+   has run at least that much longer, to avoid switching back and forth. */
+#define WAKEUP_GRANULARITY (SCHED_TICKS * NICE_0_VSLICE / 4)
+
+/*
+ * The run queue holds runnable normal tasks (policy SCHED_NORMAL), except for
+ * the current task and the idle task, sorted by virtual run time. The task
+ * with the smallest virtual run time is cached, so picking the next task is
+ * O(1), while queueing and dequeueing a task is O(log n)
+ */
+static struct rb_root runqueue = { NULL };
+static struct rb_node *runqueue_leftmost = NULL;
+
+/* Virtual run time of the runnable task that has run the least. It never
+   goes backward, so it can be used as a reference for new or waking tasks. */
+static unsigned long long min_vruntime = 0;
+
+/*
+ * Inserts the specified runnable task in the run queue. Hardware interrupts
+ * must be disabled.
+ */
+static void enqueue_task(struct task_struct *t)
+{
+    bool_t leftmost = TRUE;
+    struct rb_node **link = &runqueue.node, *parent = NULL;
+    struct task_struct *p;
+
+    while (*link) {
+        parent = *link;
+        p = rb_entry(parent, struct task_struct, rq_node);
+        if (t->vruntime < p->vruntime) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+            leftmost = FALSE;
+        }
+    }
+
+    rb_link_node(&t->rq_node, parent, link);
+    rb_insert_color(&t->rq_node, &runqueue);
+
+    if (leftmost)
+        runqueue_leftmost = &t->rq_node;
+}
+
+/*
+ * Removes the specified task from the run queue. Hardware interrupts must be
+ * disabled.
+ */
+static void dequeue_task(struct task_struct *t)
+{
+    if (runqueue_leftmost == &t->rq_node)
+        runqueue_leftmost = rb_next(&t->rq_node);
+
+    rb_erase(&t->rq_node, &runqueue);
+}
+
+/*
+ * Real-time tasks (policies SCHED_FIFO and SCHED_RR) are queued in a separate
+ * run queue, which takes precedence over the one above. There is one list
+ * per real-time priority, and bit n of rt_runqueue_map is set if the list
+ * at priority n is not empty. Unlike normal tasks, a real-time task stays
+ * at the head of its list while it runs, until it sleeps, dies, or (for
+ * SCHED_RR tasks) exhausts its time slice, in which case it moves to the
+ * tail of its list.
+ */
+static struct task_struct *rt_runqueue[RT_PRIO_MAX + 1];
+static unsigned long rt_runqueue_map = 0;
+
+/* Number of ticks since the beginning of the current RT_PERIOD. */
+static unsigned long rt_ticks_period = 0;
+
+/* Number of ticks real-time tasks ran since the beginning of the current
+   RT_PERIOD, and whether they have used up their RT_RUNTIME ticks, in which
+   case normal tasks get the CPU until the end of the period. */
+static unsigned long rt_ticks = 0;
+static bool_t rt_throttled = FALSE;
+
+#define is_rt_task(t) ((t)->policy != SCHED_NORMAL)
+
+/*
+ * Appends the specified runnable real-time task to its list in the real-time
+ * run queue. Hardware interrupts must be disabled.
+ */
+static void enqueue_rt_task(struct task_struct *t)
+{
+    list_append_named(rt_runqueue[t->rt_priority], t, rt_prev, rt_next);
+    rt_runqueue_map |= 1UL << t->rt_priority;
+}
+
 /*
- * Return the address of the stored context associated with the specified task.
- * This is called from assembly code (see task_switch.S)
+ * Removes the specified real-time task from the real-time run queue. Hardware
+ * interrupts must be disabled.
  */
-struct task_cpu_context *get_ctx(struct task_struct *t)
+static void dequeue_rt_task(struct task_struct *t)
 {
-    return t->ctx;
+    list_remove_named(rt_runqueue[t->rt_priority], t, rt_prev, rt_next);
+    if (list_empty(rt_runqueue[t->rt_priority]))
+        rt_runqueue_map &= ~(1UL << t->rt_priority);
 }
 
 /*
- * Return the address of the task_struct member holding the address of the
- * stored context associated with the specified task. This is called from
- * assembly code (see task_switch.S)
+ * Returns whether the specified task, which was just made runnable, should
+ * preempt the current task.
  */
-struct task_cpu_context **get_ctx_addr(struct task_struct *t)
+static bool_t should_preempt(struct task_struct *t)
 {
-    return &t->ctx;
+    if (current == idle_task)
+        return TRUE;
+    if (is_rt_task(t))
+        return !is_rt_task(current) ? !rt_throttled :
+            t->rt_priority > current->rt_priority;
+    if (is_rt_task(current))
+        return rt_throttled;
+    return t->vruntime + WAKEUP_GRANULARITY < current->vruntime;
 }
 
+/*
+ * Accounts for one tick spent running the current task. Hardware interrupts
+ * must be disabled.
+ */
+void sched_tick(void)
+{
+    if (++rt_ticks_period == RT_PERIOD) {
+        /* A new period starts. Let real-time tasks run again. */
+        rt_ticks_period = 0;
+        rt_ticks = 0;
+        if (rt_throttled) {
+            rt_throttled = FALSE;
+            if (rt_runqueue_map)
+                need_resched = TRUE;
+        }
+    }
+
+    if (current == idle_task)
+        return;
+
+    if (!is_rt_task(current)) {
+        current->vruntime += current->vslice;
+        return;
+    }
+
+    if (++rt_ticks >= RT_RUNTIME && !rt_throttled && runqueue_leftmost) {
+        /* Real-time tasks used up their share of this period, and normal
+           tasks are waiting for the CPU. */
+        rt_throttled = TRUE;
+        need_resched = TRUE;
+        sched_stats.rt_throttles++;
+    }
+
+    if (current->policy == SCHED_RR && current->rt_timeslice &&
+        --current->rt_timeslice == 0)
+        need_resched = TRUE;
+}
+
+/*
+ * Sets the nice value of the specified task, clamped to the range going from
+ * NICE_MIN to NICE_MAX, and updates the virtual run time it is charged per
+ * tick accordingly.
+ */
+void set_task_nice(struct task_struct *t, int nice)
+{
+    if (nice < NICE_MIN)
+        nice = NICE_MIN;
+    else if (nice > NICE_MAX)
+        nice = NICE_MAX;
+
+    t->nice = nice;
+    t->vslice = NICE_0_VSLICE * NICE_0_WEIGHT /
+        nice_to_weight[nice - NICE_MIN];
+}
+
+/*
+ * Moves the specified task to the specified scheduling policy. The priority
+ * only matters to real-time policies, and goes from 0 to RT_PRIO_MAX. Returns
+ * S_OK on success, or -E_INVALIDARG if the policy or the priority is invalid.
+ */
+ret_t set_task_scheduler(struct task_struct *t, int policy, int priority)
+{
+    bool_t queued;
+    unsigned long eflags;
+
+    if (policy != SCHED_NORMAL && policy != SCHED_FIFO && policy != SCHED_RR)
+        return -E_INVALIDARG;
+    if (priority < 0 || priority > RT_PRIO_MAX)
+        return -E_INVALIDARG;
+    if (t == idle_task)
+        return -E_INVALIDARG;
+
+    disable_hwint(eflags);
+
+    /* Take the task out of its run queue, if it is in one. The current task
+       is only in a run queue if it is a real-time task. */
+    queued = t->state == TASK_RUNNABLE && (t != current || is_rt_task(t));
+    if (queued) {
+        if (is_rt_task(t))
+            dequeue_rt_task(t);
+        else
+            dequeue_task(t);
+    }
+
+    t->policy = policy;
+    t->rt_priority = policy == SCHED_NORMAL ? 0 : priority;
+    t->rt_timeslice = RR_TIMESLICE;
+
+    if (t->state == TASK_RUNNABLE) {
+        if (is_rt_task(t)) {
+            enqueue_rt_task(t);
+        } else if (t != current) {
+            if (t->vruntime < min_vruntime)
+                t->vruntime = min_vruntime;
+            enqueue_task(t);
+        }
+        /* Let schedule sort out which task should run now. */
+        need_resched = TRUE;
+    }
+
+    restore_hwint(eflags);
+    return S_OK;
+}
+
+/* The offsets of the following members are hard-coded in assembly code (see
+   context.h) Compilation fails here if they do not match. */
+typedef char check_ctx_cs_offset[
+    __builtin_offsetof(struct task_cpu_context, cs) == CTX_CS ? 1 : -1];
+typedef char check_task_ctx_offset[
+    __builtin_offsetof(struct task_struct, ctx) == TASK_CTX ? 1 : -1];
+
 /*
  * Update the esp0 member of the TSS, the LDT descriptor in the GDT, as well as
  * the LDTR register, to point to the current task LDT. This function should be
  * called whenever we are getting ready to possibly switch to user mode (right
  * before a context restore + iret) Note: The context passed to this function
  * is the interrupt context, not the context stored in the task descriptor.
+ * The assembly code skips this call when the current task already owns the
+ * LDT (see update_tss_ldt_if_needed in context.h) Since the LDT lives in the
+ * task descriptor, its entries can change without the LDT having to be
+ * loaded again.
  */
 void update_tss_ldt(struct task_cpu_context *ctx)
 {
     uint16_t ldtr;
 
-    if (SEG_REG_RPL(ctx->cs) == USER_PRIVILEGE_LEVEL) {
+    if (SEG_REG_RPL(ctx->cs) == USER_PRIVILEGE_LEVEL && ldt_owner != current) {
         /* We are indeed switching to user space. */
         tss.esp0 = current->kstack + KSTACK_SIZE;
         gdt[GDT_LDT_INDEX] = BUILD_SEG_DESC((addr_t) current->ldt,
@@ -81,34 +337,80 @@ void update_tss_ldt(struct task_cpu_context *ctx)
             GDT_LDT_TYPE);
         ldtr = SEG_REG_VAL(KERN_PRIVILEGE_LEVEL, FALSE, GDT_LDT_INDEX);
         asm("lldt %0" : : "r" (ldtr));
+        ldt_owner = current;
     }
 }
 
 /*
- * Allocates a new process id.
+ * Bitmap of the process ids in use. Bit n % 32 of pid_map[n / 32] is set if
+ * pid n is in use. The pids of the idle task and of the init task are always
+ * reserved (see sys_fork)
+ */
+#define PID_MAP_WORDS (MAX_PID / 32 + 1)
+
+static unsigned long pid_map[PID_MAP_WORDS] = {
+    (1 << IDLE_TASK_PID) | (1 << INIT_TASK_PID)
+};
+
+/*
+ * Hash table of all the tasks in the global task list, indexed by pid, so a
+ * task can be looked up without visiting all the others.
+ */
+#define PID_HASH_SIZE 256
+
+static struct task_struct *pid_hash[PID_HASH_SIZE];
+
+#define pid_hashfn(pid) ((pid) & (PID_HASH_SIZE - 1))
+
+/*
+ * Allocates a new process id, or returns -1 if all the process ids are in
+ * use. Process ids are handed out in increasing order, starting after the
+ * last allocated one, so a process id is not reused right after it is freed.
  */
 pid_t alloc_pid(void)
 {
-    int i;
-    bool_t b;
-    static pid_t next_pid = INIT_TASK_PID;
-    struct task_struct *t;
+    unsigned int n, i;
+    unsigned long word;
+    pid_t pid = -1;
+    static pid_t next_pid = INIT_TASK_PID + 1;
     unsigned long eflags;
 
     disable_hwint(eflags);
 
-    do {
-        b = FALSE;
-        next_pid = next_pid < MAX_PID ? next_pid + 1 : INIT_TASK_PID;
-        list_for_each(task_list_head, t, i)
-            if (t->pid == next_pid) {
-                b = TRUE;
-                break;
-            }
-    } while (b);
+    /* Look for a clear bit, starting from next_pid. The bits preceding
+       next_pid in its word are only considered once we have wrapped around
+       the whole bitmap. */
+    i = next_pid / 32;
+    word = pid_map[i] | ((1UL << (next_pid % 32)) - 1);
+
+    for (n = 0; n <= PID_MAP_WORDS; n++) {
+        if (~word && i * 32 + bsf(~word) <= MAX_PID) {
+            pid = i * 32 + bsf(~word);
+            pid_map[i] |= 1UL << (pid % 32);
+            next_pid = pid < MAX_PID ? pid + 1 : INIT_TASK_PID + 1;
+            break;
+        }
+        i = i < PID_MAP_WORDS - 1 ? i + 1 : 0;
+        word = pid_map[i];
+    }
 
     restore_hwint(eflags);
-    return next_pid;
+    return pid;
+}
+
+/*
+ * Releases the specified process id, allocated using alloc_pid.
+ */
+void free_pid(pid_t pid)
+{
+    unsigned long eflags;
+
+    if (pid <= INIT_TASK_PID || pid > MAX_PID)
+        return;
+
+    disable_hwint(eflags);
+    pid_map[pid / 32] &= ~(1UL << (pid % 32));
+    restore_hwint(eflags);
 }
 
 /*
@@ -123,7 +425,7 @@ struct task_struct *get_task(pid_t pid)
 
     disable_hwint(eflags);
 
-    list_for_each(task_list_head, t, i)
+    list_for_each_named(pid_hash[pid_hashfn(pid)], t, i, hash_prev, hash_next)
         if (t->pid == pid) {
             restore_hwint(eflags);
             return t;
@@ -140,8 +442,9 @@ struct task_struct *get_task(pid_t pid)
  */
 void init_multitasking(void)
 {
+    int i;
     uint16_t ldtr;
-    struct task_struct *t;
+    struct task_struct *t, *p;
 
     /* The end of the kernel's text section. */
     extern char __e_text;
@@ -153,20 +456,26 @@ void init_multitasking(void)
     extern addr_t syscall_handler;
 
     /* Get a new task descriptor for the idle task and initialize it. */
-    t = kmalloc(sizeof(struct task_struct));
+    t = alloc_task_struct();
     if (!t) goto error;
     t->pid = IDLE_TASK_PID;
     t->ppid = -1;
+    t->parent = NULL;
     t->state = TASK_RUNNABLE;
-    t->timeslice = 0;
+    t->nice = 0;
+    t->policy = SCHED_NORMAL;
 
     /* Allocate some space for the idle task's kernel-space stack. */
     if (alloc_physmem_block(KSTACK_PAGES, &t->kstack) != S_OK)
         goto error;
 
     /* Setup the idle task ldt. */
-    t->ldt[LDT_CS_INDEX] = BUILD_4KB_SEG_DESC(0, (addr_t) &__e_text, LDT_CS_TYPE);
-    t->ldt[LDT_DS_INDEX] = BUILD_4KB_SEG_DESC(0, (addr_t) &__idle_ustack, LDT_DS_TYPE);
+    t->ldt[LDT_CS_INDEX] = BUILD_4KB_SEG_DESC(0, (addr_t) &__e_text,
+        LDT_CS_TYPE);
+    t->ldt[LDT_DS_INDEX] = BUILD_4KB_SEG_DESC(0, (addr_t) &__idle_ustack,
+        LDT_DS_TYPE);
+    t->ldt[LDT_KINFO_INDEX] = BUILD_SEG_DESC((addr_t) &kinfo,
+        sizeof(struct kinfo) - 1, LDT_KINFO_TYPE);
 
     /* Set the esp0 member of the TSS and initialize the LDTR register so we
        can reenter kernel space once we have entered user space below
@@ -177,6 +486,7 @@ void init_multitasking(void)
         GDT_LDT_TYPE);
     ldtr = SEG_REG_VAL(KERN_PRIVILEGE_LEVEL, FALSE, GDT_LDT_INDEX);
     asm("lldt %0" : : "r" (ldtr));
+    ldt_owner = t;
 
     /* Save the idle task reference. This avoids having to look it up later. */
     idle_task = t;
@@ -187,17 +497,33 @@ void init_multitasking(void)
 
     /* Mark the idle task as the current task. */
     current = t;
+    kinfo.pid = t->pid;
+    kinfo.ppid = t->ppid;
+
+    /* The idle task adopts the kernel threads started so far. It hands them
+       over to the init task when it creates it (see sys_fork) */
+    list_for_each(task_list_head, p, i) {
+        p->parent = t;
+        p->ppid = t->pid;
+        list_append_named(t->children, p, sibling_prev, sibling_next);
+    }
 
-    /* And apend it to the global task list. */
+    /* And apend it to the global task list. The idle task is never queued
+       in the run queue. */
     list_append(task_list_head, t);
+    list_append_named(pid_hash[pid_hashfn(t->pid)], t, hash_prev, hash_next);
 
-    /* Set the system call handler in the IDT. */
-    idt_set_handler(SYSCALL_INT_NUM, (addr_t) &syscall_handler, USER_PRIVILEGE_LEVEL);
+    /* Set the system call handler in the IDT, and use SYSENTER instead if
+       the processor supports it. */
+    idt_set_handler(SYSCALL_INT_NUM, (addr_t) &syscall_handler,
+        USER_PRIVILEGE_LEVEL);
+    init_sysenter();
 
     /* Move to user space. This is some cool magic I learned by looking at the
        code of an early version of Linux, and by adapting it a bit. Note that
        this will enable interrupts: the EFLAGS register gets set to 0x200,
-       which corresponds to IF = 1 */
+       which corresponds to IF = 1. User tasks keep the kernel information
+       segment in GS (see kinfo.h) */
     asm("mov %%esp, %%eax;"
         "pushl %0;"
         "pushl %%eax;"
@@ -209,10 +535,12 @@ void init_multitasking(void)
         "mov %%ax, %%ds;"
         "mov %%ax, %%es;"
         "mov %%ax, %%fs;"
+        "mov %2, %%ax;"
         "mov %%ax, %%gs;"
         :
         : "i" (LDT_DS),
-          "i" (LDT_CS)
+          "i" (LDT_CS),
+          "i" (LDT_KINFO)
         : "eax");
 
     return;
@@ -223,66 +551,181 @@ error:
 }
 
 /*
- * Elects a new task to execute, among the list of runnable tasks, and switch
- * to that task. This scheduling algorithm is ridiculously simple and not
- * particularly efficient. It should however be fair to interactive jobs,
- * while doing its best to accomodate CPU intensive tasks.
+ * Returns whether any task other than the idle task is runnable.
+ */
+bool_t has_runnable_tasks(void)
+{
+    return runqueue_leftmost != NULL || rt_runqueue_map != 0;
+}
+
+/*
+ * Adds the specified new task, which must be runnable, to the global task
+ * list, to the pid hash table, and to the run queue. The new task starts one
+ * tick behind the task that has run the least, so creating tasks cannot
+ * starve the others.
+ */
+void add_task(struct task_struct *t)
+{
+    unsigned long eflags;
+
+    disable_hwint(eflags);
+    set_task_nice(t, t->nice);
+    t->vruntime = min_vruntime + t->vslice;
+    t->rt_timeslice = RR_TIMESLICE;
+    list_append(task_list_head, t);
+    list_append_named(pid_hash[pid_hashfn(t->pid)], t, hash_prev, hash_next);
+    if (t->parent) {
+        list_append_named(t->parent->children, t, sibling_prev, sibling_next);
+    }
+    if (is_rt_task(t))
+        enqueue_rt_task(t);
+    else
+        enqueue_task(t);
+    restore_hwint(eflags);
+}
+
+/*
+ * Removes the specified dead task from the global task list and from the
+ * zombies list of its parent, and releases its process id. The task
+ * descriptor can then be freed.
+ */
+void remove_task(struct task_struct *t)
+{
+    unsigned long eflags;
+
+    ASSERT(t->state == TASK_DEAD);
+
+    disable_hwint(eflags);
+    /* The descriptor of the task may be reused by a new task, which will
+       have a different kernel-space stack. */
+    if (ldt_owner == t)
+        ldt_owner = NULL;
+    list_remove(task_list_head, t);
+    list_remove_named(t->parent->zombies, t, sibling_prev, sibling_next);
+    list_remove_named(pid_hash[pid_hashfn(t->pid)], t, hash_prev, hash_next);
+    free_pid(t->pid);
+    restore_hwint(eflags);
+}
+
+/*
+ * Elects a new task to execute, among the runnable tasks, and switch to that
+ * task. Runnable real-time tasks always run first, highest priority first,
+ * unless they have been throttled (see sched_tick) Otherwise, the task that
+ * has received the least CPU time relative to its weight (i.e. the one with
+ * the smallest virtual run time) gets the CPU, so every task gets a share of
+ * the CPU proportional to its weight, and tasks that spend most of their time
+ * sleeping get the CPU promptly when they wake up.
  */
 void schedule(void)
 {
-    int i, n = 0;
-    struct task_struct *t, *next = NULL;
+    unsigned long latency;
+    struct task_struct *next;
     unsigned long eflags;
 
     disable_hwint(eflags);
 
-    /* Find the runnable task with the highest possible remaining time slice. */
-    list_for_each(task_list_head, t, i)
-        if (t->state == TASK_RUNNABLE && t->timeslice > n)
-            n = t->timeslice, next = t;
-
-    if (!n) {
-        /* We could not find a runnable task with a remaining time slice.
-           If the only runnable task is the idle task, give it the CPU.
-           Otherwise, adjust the time slice of all tasks and give the CPU
-           to one of the runnable tasks. */
-        list_for_each(task_list_head, t, i)
-            if (t->pid != IDLE_TASK_PID) {
-                t->timeslice += TIMESLICE_INCREMENT;
-                if (t->timeslice > MAX_TIMESLICE)
-                    t->timeslice = MAX_TIMESLICE;
-                if (t->state == TASK_RUNNABLE)
-                    next = t;
-            }
+    need_resched = FALSE;
+
+    if (is_rt_task(current)) {
+        if (current->state != TASK_RUNNABLE) {
+            /* The current task is going to sleep or dying. */
+            dequeue_rt_task(current);
+        } else if (current->policy == SCHED_RR && !current->rt_timeslice) {
+            /* Let the other tasks at the same priority take their turn. */
+            current->rt_timeslice = RR_TIMESLICE;
+            dequeue_rt_task(current);
+            enqueue_rt_task(current);
+        }
+    } else if (current != idle_task && current->state == TASK_RUNNABLE) {
+        /* Put the current task back in the run queue, at the position its
+           virtual run time now corresponds to. */
+        enqueue_task(current);
     }
 
-    if (!next) {
+    if (rt_runqueue_map && (!rt_throttled || !runqueue_leftmost)) {
+        next = rt_runqueue[bsr(rt_runqueue_map)];
+    } else if (runqueue_leftmost) {
+        next = rb_entry(runqueue_leftmost, struct task_struct, rq_node);
+        dequeue_task(next);
+        if (next->vruntime > min_vruntime)
+            min_vruntime = next->vruntime;
+    } else {
         /* The idle task is the only runnable task. */
         next = idle_task;
     }
 
+    if (next->wakeup_tsc) {
+        latency = rdtsc() - next->wakeup_tsc;
+        next->wakeup_tsc = 0;
+        next->wakeup_latency = latency;
+        sched_stats.wakeup_latency += latency;
+        if (latency > sched_stats.max_wakeup_latency)
+            sched_stats.max_wakeup_latency = latency;
+    }
+
     if (next != current) {
-        /* Finally, do the actual task switch. */
+        /* Let the next task read its own pid without a system call. */
+        kinfo_update_begin();
+        kinfo.pid = next->pid;
+        kinfo.ppid = next->ppid;
+        kinfo_update_end();
+
+        /* Finally, do the actual task switch. The FPU state follows lazily. */
+        fpu_switch(next);
         task_switch(next);
     }
 
     restore_hwint(eflags);
 }
 
+/*
+ * Makes the specified sleeping task runnable again. If that task has a higher
+ * real-time priority than the current task, or if neither task is real-time
+ * and it has run sufficiently less than the current task, it gets the CPU
+ * when the current interrupt or system call returns (see isr.S and syscall.S)
+ */
 void wake_up(struct task_struct *t)
 {
+    unsigned long eflags;
+
     ASSERT(t->state == TASK_INTERRUPTIBLE || t->state == TASK_UNINTERRUPTIBLE);
+
+    disable_hwint(eflags);
     t->state = TASK_RUNNABLE;
+    if (is_rt_task(t)) {
+        enqueue_rt_task(t);
+    } else {
+        if (min_vruntime > SLEEPER_CREDIT &&
+            t->vruntime < min_vruntime - SLEEPER_CREDIT)
+            t->vruntime = min_vruntime - SLEEPER_CREDIT;
+        enqueue_task(t);
+    }
+    t->wakeup_tsc = rdtsc();
+    sched_stats.wakeups++;
+
+    if (WAKEUP_PREEMPTION && !need_resched && should_preempt(t)) {
+        need_resched = TRUE;
+        sched_stats.wakeup_preemptions++;
+    }
+
+    restore_hwint(eflags);
 }
 
-void sleep_on()
+/*
+ * Puts the current task to sleep in the specified state, and gives the CPU
+ * to another task.
+ */
+static void sleep_in_state(int state)
 {
-    current->state = TASK_UNINTERRUPTIBLE;
+    unsigned long eflags;
+
+    disable_hwint(eflags);
+    current->state = state;
     schedule();
+    restore_hwint(eflags);
 }
 
-void interruptible_sleep_on()
+void sleep_on()
 {
-    current->state = TASK_INTERRUPTIBLE;
-    schedule();
+    sleep_in_state(TASK_UNINTERRUPTIBLE);
 }
@@ -30,11 +30,16 @@
 #include <simplix/context.h>
 #include <simplix/globals.h>
 #include <simplix/list.h>
+#include <simplix/macros.h>
 #include <simplix/proto.h>
 #include <simplix/segment.h>
 #include <simplix/task.h>
+#include <simplix/tss.h>
 #include <simplix/types.h>
 
+/* Set if system calls are made with SYSENTER (see init_sysenter) */
+bool_t sysenter_enabled = FALSE;
+
 long sys_exit(struct task_cpu_context *ctx)
 {
     do_exit(ctx->ebx);
@@ -45,14 +50,41 @@ long sys_exit(struct task_cpu_context *ctx)
     return 0;
 }
 
+/*
+ * Mover of the physical memory block holding the code and data segments of a
+ * user task (see set_physmem_block_mover) Since the task only ever addresses
+ * its segments through its LDT, relocating them is just a matter of updating
+ * the base of its LDT entries. This is called with hardware interrupts
+ * disabled, so the task cannot run before its segments have been copied.
+ */
+static bool_t move_task_segments(void *owner, addr_t new_addr)
+{
+    size_t cs_size, ds_size;
+    struct task_struct *t = owner;
+
+    /* The current task may be in the middle of a system call that has
+       computed physical addresses inside of its segments. Tasks that are
+       not running are either in user space, or sleeping in a system call
+       that does not hold such addresses across the sleep. */
+    if (t == current)
+        return FALSE;
+
+    cs_size = SEG_SIZE(&t->ldt[LDT_CS_INDEX]);
+    ds_size = SEG_SIZE(&t->ldt[LDT_DS_INDEX]);
+    t->ldt[LDT_CS_INDEX] = BUILD_4KB_SEG_DESC(new_addr, cs_size, LDT_CS_TYPE);
+    t->ldt[LDT_DS_INDEX] = BUILD_4KB_SEG_DESC(new_addr, ds_size, LDT_DS_TYPE);
+
+    return TRUE;
+}
+
 long sys_fork(struct task_cpu_context *ctx)
 {
     struct task_struct *t = NULL;
-    addr_t cur_cs_addr, cur_ds_addr, new_cs_addr, new_ds_addr;
+    addr_t cur_cs_addr, cur_ds_addr, new_cs_addr, new_ds_addr = 0;
     size_t cur_cs_size, cur_ds_size, new_cs_size, new_ds_size;
 
     /* Get a new task descriptor and initialize it. */
-    t = kmalloc(sizeof(struct task_struct));
+    t = alloc_task_struct();
     if (!t) goto error;
 
     /* This guarantees that the init task has a known process id, even if
@@ -61,11 +93,15 @@ long sys_fork(struct task_cpu_context *ctx)
         t->pid = INIT_TASK_PID;
     } else {
         t->pid = alloc_pid();
+        if (t->pid == -1) goto error;
     }
 
     t->ppid = current->pid;
+    t->parent = current;
     t->state = TASK_RUNNABLE;
-    t->timeslice = current->timeslice;
+    t->nice = current->nice;
+    t->policy = current->policy;
+    t->rt_priority = current->rt_priority;
 
     /* Allocate some space for the task's kernel-space stack. We use the fast
        version of alloc_physmem_block because we overwrite the content of that
@@ -76,6 +112,10 @@ long sys_fork(struct task_cpu_context *ctx)
     /* Copy the current task kernel-space stack. */
     memcpy((void *) t->kstack, (void *) current->kstack, KSTACK_SIZE);
 
+    /* Copy the current task FPU state. */
+    if (fpu_fork(t) != S_OK)
+        goto error;
+
     /* Get the address and size of the current task data segment. */
     cur_cs_addr = SEG_ADDR(&current->ldt[LDT_CS_INDEX]);
     cur_ds_addr = SEG_ADDR(&current->ldt[LDT_DS_INDEX]);
@@ -102,6 +142,10 @@ long sys_fork(struct task_cpu_context *ctx)
     /* Initialize the new task LDT. */
     t->ldt[LDT_CS_INDEX] = BUILD_4KB_SEG_DESC(new_cs_addr, new_cs_size, LDT_CS_TYPE);
     t->ldt[LDT_DS_INDEX] = BUILD_4KB_SEG_DESC(new_ds_addr, new_ds_size, LDT_DS_TYPE);
+    t->ldt[LDT_KINFO_INDEX] = current->ldt[LDT_KINFO_INDEX];
+
+    /* The new task segments can be moved around to compact physical memory. */
+    set_physmem_block_mover(new_ds_addr, &move_task_segments, t);
 
     /* Initialize the new task context. */
     t->ctx = (struct task_cpu_context *) (t->kstack + KSTACK_SIZE
@@ -110,17 +154,25 @@ long sys_fork(struct task_cpu_context *ctx)
     /* Set return value in EAX register for the new task. */
     t->ctx->eax = 0;
 
-    /* Append the new task to the global task list. */
-    list_append(task_list_head, t);
+    /* The init task adopts the kernel threads started at boot time, which
+       the idle task has been looking after until now. */
+    if (t->pid == INIT_TASK_PID)
+        reparent_children(current, t);
+
+    /* Append the new task to the global task list and to the run queue. */
+    add_task(t);
 
     printk("[pid %u] forking process -> new process has pid %u\n", current->pid, t->pid);
     return t->pid;
 
 error:
 
-    /* Free the memory we allocated. */
+    /* Free the memory and the pid we allocated. */
     if (new_ds_addr) free_physmem_block(new_ds_addr);
     if (t && t->kstack) free_physmem_block(t->kstack);
+    if (t && t->fpu) kfree(t->fpu);
+    if (t) t->fpu = NULL;
+    if (t) free_pid(t->pid);
     if (t) kfree(t);
     return -1;
 }
@@ -131,13 +183,11 @@ long sys_waitpid(struct task_cpu_context *ctx)
     int status;
     addr_t vaddr, paddr;
 
-    /* Compute the physical memory address of the variable that is going
-       to receive the exit status of the task with the specified pid.
-       Return -1 if the specified virtual address is invalid. */
+    /* Make sure that the variable that is going to receive the exit status
+       of the task with the specified pid is valid. Return -1 otherwise. */
     vaddr = ctx->ecx;
     if (!VALIDATE_VMEM_AREA(vaddr, sizeof(pid_t)))
         return -1;
-    paddr = GET_PHYSMEM_ADDR(vaddr);
 
     /* Get the pid of the child we want to wait for. */
     pid = ctx->ebx;
@@ -145,7 +195,10 @@ long sys_waitpid(struct task_cpu_context *ctx)
     /* do_waitpid does most of the work. */
     pid = do_waitpid(pid, &status);
     if (pid != -1) {
-        /* Copy the exit status to the appropriate physical address. */
+        /* Copy the exit status to the appropriate physical address. Note
+           that this address must be computed after do_waitpid returns, since
+           our segments may have been moved while we were sleeping. */
+        paddr = GET_PHYSMEM_ADDR(vaddr);
         *((int *) paddr) = status;
     }
 
@@ -180,7 +233,7 @@ long sys_stime(struct task_cpu_context *ctx)
     paddr = GET_PHYSMEM_ADDR(vaddr);
 
     /* Update the wall clock. */
-    realtime = *((time_t *) paddr);
+    set_realtime(*((time_t *) paddr));
 
     return 0;
 }
@@ -196,7 +249,7 @@ long sys_sleep(struct task_cpu_context *ctx)
 long sys_brk(struct task_cpu_context *ctx)
 {
     addr_t addr, cs_addr, ds_addr;
-    size_t size, cs_size, ds_size;
+    size_t size, cs_size, ds_size, capacity;
 
     /* The new size for the data segment is stored in EBX. */
     size = PAGE_ALIGN_SUP(ctx->ebx);
@@ -218,9 +271,29 @@ long sys_brk(struct task_cpu_context *ctx)
         return ds_size;
     }
 
-    /* Do the actual reallocation. */
-    if (realloc_physmem_block(ds_addr, size >> PAGE_BIT_SHIFT, &addr) != S_OK)
-        return ds_size;
+    /* The physical memory block holding the data segment may be larger than
+       the data segment itself (see BRK_GEOMETRIC_RESERVE in consts.h) The
+       memory past the end of the data segment is always kept clean. */
+    capacity = get_physmem_block_size(ds_addr) << PAGE_BIT_SHIFT;
+
+    if (BRK_GEOMETRIC_RESERVE && size <= capacity && size * 4 > capacity) {
+
+        /* The new break falls within the reserved memory, and we are not
+           wasting too much of it. We just need to adjust the task's LDT. */
+        if (size < ds_size)
+            memset((void *) (ds_addr + size), 0, ds_size - size);
+        else
+            physmem_stats.realloc_avoided_bytes += ds_size;
+        addr = ds_addr;
+
+    } else if (!BRK_GEOMETRIC_RESERVE || size <= ds_size ||
+        realloc_physmem_block(ds_addr, (size << 1) >> PAGE_BIT_SHIFT, &addr) != S_OK) {
+
+        /* Do the actual reallocation. When growing the data segment, we only
+           get here if reserving twice as much memory as needed failed. */
+        if (realloc_physmem_block(ds_addr, size >> PAGE_BIT_SHIFT, &addr) != S_OK)
+            return ds_size;
+    }
 
     /* Adjust the task's LDT. */
     current->ldt[LDT_CS_INDEX] = BUILD_4KB_SEG_DESC(addr, cs_size, LDT_CS_TYPE);
@@ -229,3 +302,178 @@ long sys_brk(struct task_cpu_context *ctx)
     /* Return the current break value. */
     return size;
 }
+
+long sys_idle(struct task_cpu_context *ctx)
+{
+    /* Only the idle task may park itself in kernel space. */
+    if (current != idle_task)
+        return -1;
+
+    /* Hardware interrupts are disabled while servicing a system call, and
+       we are never going to return from this one, so re-enable them. */
+    sti();
+
+    /* Use the time nobody else wants to fill free pages with zeros. This
+       saves the tasks that need zeroed memory from doing it themselves.
+       Once every free page is clean, wait for the next interrupt. */
+    for (;;)
+        if (!zero_free_page())
+            idle_halt();
+
+    return 0;
+}
+
+long sys_nice(struct task_cpu_context *ctx)
+{
+    /* The nice value of the idle task does not matter. */
+    if (current == idle_task)
+        return -1;
+
+    /* Add the increment stored in EBX to the nice value of the current task,
+       and return the resulting nice value. */
+    set_task_nice(current, current->nice + (int) ctx->ebx);
+    return current->nice;
+}
+
+long sys_setpriority(struct task_cpu_context *ctx)
+{
+    struct task_struct *t;
+
+    /* The pid of the task is stored in EBX, 0 meaning the current task. */
+    t = ctx->ebx ? get_task(ctx->ebx) : current;
+    if (!t || t == idle_task)
+        return -1;
+
+    /* Set the nice value stored in ECX. */
+    set_task_nice(t, (int) ctx->ecx);
+    return 0;
+}
+
+long sys_sched_setscheduler(struct task_cpu_context *ctx)
+{
+    struct task_struct *t;
+
+    /* The pid of the task is stored in EBX, 0 meaning the current task. */
+    t = ctx->ebx ? get_task(ctx->ebx) : current;
+    if (!t)
+        return -1;
+
+    /* The policy is stored in ECX, and the real-time priority in EDX. */
+    return set_task_scheduler(t, ctx->ecx, ctx->edx) == S_OK ? 0 : -1;
+}
+
+/*
+ * Makes the system calls described by an array of records, in a single trip
+ * through the kernel. Stops at the first system call returning a negative
+ * value (beware that nice may legitimately do so), or that cannot be batched:
+ * fork, which needs the real context of the task, brk, which may shrink the
+ * segment holding the records, and the idle and batch system calls. Returns
+ * the number of system calls that succeeded, or -1 if the array is invalid.
+ */
+long sys_syscall_batch(struct task_cpu_context *ctx)
+{
+    struct task_cpu_context call_ctx;
+    struct syscall_record *rec;
+    unsigned long i, n;
+    addr_t vaddr;
+    long res;
+
+    /* Our system call table (see syscall.S) */
+    extern long (*syscall_table[])(struct task_cpu_context *);
+
+    /* The address of the array is stored in EBX, and its length in ECX.
+       Validate the whole array once and for all. */
+    vaddr = ctx->ebx;
+    n = ctx->ecx;
+    if (n > SYSCALL_BATCH_MAX ||
+        !VALIDATE_VMEM_AREA(vaddr, n * sizeof(struct syscall_record)))
+        return -1;
+
+    /* Each system call sees the context of the task, with its own number
+       and arguments in place of ours. */
+    call_ctx = *ctx;
+
+    for (i = 0; i < n; i++, vaddr += sizeof(struct syscall_record)) {
+
+        /* The physical address of the record must be computed again after
+           each system call, since our segments may have been moved while we
+           were sleeping in it. */
+        rec = (struct syscall_record *) GET_PHYSMEM_ADDR(vaddr);
+
+        switch (rec->nr) {
+            case SYSCALL_FORK:
+            case SYSCALL_BRK:
+            case SYSCALL_IDLE:
+            case SYSCALL_BATCH:
+                res = -E_INVALIDARG;
+                break;
+
+            default:
+                if (rec->nr >= NR_SYSCALLS) {
+                    res = -E_NOSYS;
+                    break;
+                }
+                call_ctx.eax = rec->nr;
+                call_ctx.ebx = rec->args[0];
+                call_ctx.ecx = rec->args[1];
+                call_ctx.edx = rec->args[2];
+                res = syscall_table[rec->nr](&call_ctx);
+                rec = (struct syscall_record *) GET_PHYSMEM_ADDR(vaddr);
+                break;
+        }
+
+        rec->result = res;
+        if (res < 0)
+            break;
+    }
+
+    return i;
+}
+
+/* Model-specific registers holding the code segment selector, stack pointer
+   and instruction pointer loaded by the SYSENTER instruction. */
+#define MSR_SYSENTER_CS  0x174
+#define MSR_SYSENTER_ESP 0x175
+#define MSR_SYSENTER_EIP 0x176
+
+/* SEP flag of the feature flags returned in EDX by CPUID. */
+#define CPUID_SEP (1 << 11)
+
+/*
+ * Sets up the SYSENTER instruction, if the processor supports it, as a faster
+ * alternative to int SYSCALL_INT_NUM for making system calls (see syscall.S)
+ * This must be done before the idle task forks the init task, since the user
+ * tasks read sysenter_enabled from their own copy of the kernel data.
+ */
+void init_sysenter(void)
+{
+    unsigned long eax, ebx, ecx, edx, family, model, stepping;
+
+    /* Our low level SYSENTER handler (see syscall.S) */
+    extern addr_t sysenter_handler;
+
+    if (!has_cpuid())
+        return;
+
+    cpuid(1, eax, ebx, ecx, edx);
+    if (!(edx & CPUID_SEP))
+        return;
+
+    /* The first Pentium Pro processors set the SEP flag, but do not actually
+       support SYSENTER. */
+    family = (eax >> 8) & 0xf;
+    model = (eax >> 4) & 0xf;
+    stepping = eax & 0xf;
+    if (family == 6 && model < 3 && stepping < 3)
+        return;
+
+    /* SYSENTER loads CS with the selector below, and SS with the next one in
+       the GDT, which is indeed our data segment. Since the kernel-space stack
+       depends on the current task, ESP is loaded with the address of the
+       esp0 member of the TSS, which the handler then dereferences. */
+    wrmsr(MSR_SYSENTER_CS, GDT_CS);
+    wrmsr(MSR_SYSENTER_ESP, (addr_t) &tss.esp0);
+    wrmsr(MSR_SYSENTER_EIP, (addr_t) &sysenter_handler);
+
+    sysenter_enabled = TRUE;
+}
@@ -37,21 +37,81 @@
 #include <simplix/task.h>
 #include <simplix/types.h>
 
+/* Slab of task descriptors. */
+static struct kmem_slab *task_slab;
+
+/*
+ * Constructor of the task descriptors in task_slab. A task descriptor is
+ * freed once its task has terminated and has been reaped, at which point
+ * these members are back to the state they are set to here: the children
+ * of the task have been adopted by its parent (see reparent_children) nobody
+ * waits for them anymore, its FPU state has been released (see fpu_exit) and
+ * its last wake-up has been accounted for (see schedule)
+ */
+static void task_ctor(void *object)
+{
+    struct task_struct *t = object;
+
+    t->children = t->zombies = NULL;
+    init_wait_queue(&t->wait_child_exit);
+    t->fpu = NULL;
+    t->wakeup_tsc = 0;
+}
+
+/*
+ * Creates the slab of task descriptors.
+ */
+void init_task_slab(void)
+{
+    task_slab = kmem_slab_create("task", sizeof(struct task_struct),
+        &task_ctor);
+    if (!task_slab)
+        panic("Could not create the slab of task descriptors");
+}
+
+/*
+ * Returns a new task descriptor, or NULL if we are out of memory. The members
+ * that are the same in every freed descriptor are set by task_ctor, and the
+ * scheduling members and list linkage pointers by add_task, so only the
+ * members that the callers do not always set are initialized here. The rest
+ * of the descriptor is garbage. Note: Don't forget to update this function,
+ * or task_ctor, when adding members to struct task_struct!
+ */
+struct task_struct *alloc_task_struct(void)
+{
+    struct task_struct *t = kmem_slab_alloc(task_slab);
+
+    if (t) {
+        t->cputime = 0;
+        t->exit_status = 0;
+        t->kstack = 0;
+        t->wakeup_latency = 0;
+    }
+
+    return t;
+}
+
 /*
  * Creates a new kernel-space task, also known as kernel thread.
  */
 pid_t kernel_thread(task_entry_point_t fn)
 {
     struct task_struct *t;
-    unsigned long eflags;
 
     /* Get a new task descriptor and initialize it. */
-    t = kmalloc(sizeof(struct task_struct));
+    t = alloc_task_struct();
     if (!t) goto error;
     t->pid = alloc_pid();
+    if (t->pid == -1) goto error;
     t->ppid = current != NULL ? current->pid : -1;
+    t->parent = current;
     t->state = TASK_RUNNABLE;
-    t->timeslice = INITIAL_TIMESLICE;
+    t->nice = 0;
+    t->policy = SCHED_NORMAL;
+    t->rt_priority = 0;
+
+    /* Kernel threads have no LDT. */
+    memset(t->ldt, 0, sizeof(t->ldt));
 
     /* Allocate some space for the task's stack. */
     if (alloc_physmem_block(KSTACK_PAGES, &t->kstack) != S_OK)
@@ -68,10 +128,8 @@ pid_t kernel_thread(task_entry_point_t fn)
     t->ctx->es = GDT_DS;
     t->ctx->ds = GDT_DS;
 
-    /* Append the new task to the global task list. */
-    disable_hwint(eflags);
-    list_append(task_list_head, t);
-    restore_hwint(eflags);
+    /* Append the new task to the global task list and to the run queue. */
+    add_task(t);
 
     printk("New kernel thread created with pid %u\n", t->pid);
 
@@ -80,20 +138,46 @@ pid_t kernel_thread(task_entry_point_t fn)
 
 error:
 
-    /* Free the memory we allocated. */
+    /* Free the memory and the pid we allocated. */
     if (t && t->kstack) free_physmem_block(t->kstack);
+    if (t) free_pid(t->pid);
     if (t) kfree(t);
     return -1;
 }
 
+/*
+ * Makes the specified new parent task adopt all the children, running or
+ * terminated, of the specified task. Hardware interrupts must be disabled.
+ */
+void reparent_children(struct task_struct *t, struct task_struct *parent)
+{
+    struct task_struct *child;
+
+    while (!list_empty(t->children)) {
+        child = list_pop_head_named(t->children, sibling_prev, sibling_next);
+        child->parent = parent;
+        child->ppid = parent->pid;
+        list_append_named(parent->children, child, sibling_prev, sibling_next);
+    }
+
+    if (!list_empty(t->zombies)) {
+        while (!list_empty(t->zombies)) {
+            child = list_pop_head_named(t->zombies, sibling_prev, sibling_next);
+            child->parent = parent;
+            child->ppid = parent->pid;
+            list_append_named(parent->zombies, child, sibling_prev, sibling_next);
+        }
+        wait_queue_wake_all(&parent->wait_child_exit);
+    }
+}
+
 /*
  * Terminates the current task with the specified error code.
  */
 void do_exit(int status)
 {
-    int i;
     addr_t seg_addr;
-    struct task_struct *t, *p;
+    struct task_struct *p = current->parent;
 
     /* IF will be reset at the next task switch. */
     cli();
@@ -107,18 +191,12 @@ void do_exit(int status)
     current->state = TASK_DEAD;
     current->exit_status = status;
 
-    /* If this task does not have a parent (case of kernel threads started
-       at boot time), make the init task the parent task. */
-    if (current->ppid == -1)
-        current->ppid = INIT_TASK_PID;
-
     /* Re-parent children tasks. */
-    list_for_each(task_list_head, t, i)
-        if (t->ppid == current->pid)
-            t->ppid = current->ppid;
+    reparent_children(current, p);
 
     /* Free the resources associated with the current task. */
     free_physmem_block(current->kstack);
+    fpu_exit(current);
 
     if (current->ldt[LDT_CS_INDEX].type != 0) {
         /* This is a user task. */
@@ -126,61 +204,78 @@ void do_exit(int status)
         free_physmem_block(seg_addr);
     }
 
-    p = get_task(current->ppid);
-
-    /* Note: kernel threads started at boot time don't have a parent! */
-    if (p && p->state == TASK_INTERRUPTIBLE) {
-        /* Wake up the parent task. */
-        p->state = TASK_RUNNABLE;
-    }
+    /* Move to the zombies list of the parent task, and wake it up if it is
+       waiting for us. */
+    list_remove_named(p->children, current, sibling_prev, sibling_next);
+    list_append_named(p->zombies, current, sibling_prev, sibling_next);
+    wait_queue_wake_all(&p->wait_child_exit);
 
     /* Finally, give the CPU to another task. */
     schedule();
 }
 
 /*
- * Waits for the task with the specified pid.
+ * Returns whether the child task of the current task with the pid pointed to
+ * by the specified argument, or any child task if that pid is -1, has
+ * terminated.
+ */
+static bool_t child_exited(void *data)
+{
+    pid_t pid = *(pid_t *) data;
+    struct task_struct *t;
+
+    if (pid == -1)
+        return !list_empty(current->zombies);
+
+    t = get_task(pid);
+    return t && t->state == TASK_DEAD;
+}
+
+/*
+ * Waits for the child task with the specified pid, or for any child task if
+ * pid is -1, to terminate. Returns the pid of that child, or -1 if there is
+ * no such child.
  */
 pid_t do_waitpid(pid_t pid, int *status)
 {
-    int i;
-    bool_t found;
     struct task_struct *t;
     unsigned long eflags;
 
     printk("[pid %u] waiting for child with pid = %d\n", current->pid, pid);
 
-repeat:
-
-    found = FALSE;
     disable_hwint(eflags);
 
-    list_for_each(task_list_head, t, i)
-        if (t->ppid == current->pid && (pid == -1 || t->pid == pid)) {
-            found = TRUE;
-            if (t->state == TASK_DEAD) {
-                list_remove(task_list_head, t);
-                restore_hwint(eflags);
-                *status = t->exit_status;
-                pid = t->pid;
-                kfree(t);
-                printk("[pid %u] all resources used by pid = %d freed\n", current->pid, pid);
-                return pid;
-            }
+    for (;;) {
+        if (pid == -1) {
+            if (list_empty(current->children) && list_empty(current->zombies))
+                break;
+            t = current->zombies;
+        } else {
+            t = get_task(pid);
+            if (!t || t->parent != current)
+                break;
+            if (t->state != TASK_DEAD)
+                t = NULL;
         }
 
-    restore_hwint(eflags);
+        if (t) {
+            remove_task(t);
+            restore_hwint(eflags);
+            *status = t->exit_status;
+            pid = t->pid;
+            kfree(t);
+            printk("[pid %u] all resources used by pid = %d freed\n", current->pid, pid);
+            return pid;
+        }
 
-    if (!found) {
-        /* This task does not have a child with the specified pid,
-           or does not have any children to wait for. */
-        return -1;
+        /* Only our own children wake us up, when they terminate. */
+        wait_event(&current->wait_child_exit, &child_exited, &pid, FALSE, 0);
     }
 
-    interruptible_sleep_on();
-
-    /* We were awoken. Check again! */
-    goto repeat;
+    /* This task does not have a child with the specified pid,
+       or does not have any children to wait for. */
+    restore_hwint(eflags);
+    return -1;
 }
 
 /*
@@ -198,7 +293,10 @@ void do_sleep(unsigned long msec)
     if (current->pid == IDLE_TASK_PID)
         panic("The idle task is trying to sleep.");
 
-    timeout = (msec * HZ) / 1000;
-    current->timeout = (unsigned long) timeout;
-    sleep_on();
+    timeout = ((unsigned long long) msec * HZ) / 1000;
+    if (!timeout)
+        timeout = 1;
+
+    /* Wait on no queue at all, so only the timeout wakes us up. */
+    wait_event(NULL, NULL, NULL, FALSE, (unsigned long) timeout);
 }
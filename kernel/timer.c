@@ -23,6 +23,19 @@
  * This file contains code responsible for keeping track of time, as well as
  * miscellaneous time-related functions.
  *
+ * Kernel timers are kept in a hashed timing wheel: the slot of a timer is
+ * given by the low bits of the tick at which it expires, and the timers of
+ * a slot are sorted by expiration time. At each tick, only the timers at the
+ * beginning of the current slot that are due get looked at, so the cost of
+ * a tick does not depend on the number of tasks or pending timers.
+ *
+ * With DYNAMIC_TICKS, the PIT is switched to one-shot mode while the idle
+ * task has nothing to do, so that it only fires when the next timer expires
+ * (or after PIT_MAX_IDLE_TICKS) The ticks that went by are accounted for
+ * when the CPU wakes up, before the interrupt that woke it up gets handled
+ * (see stop_idle_countdown) so that neither its handler nor the tasks it
+ * wakes up run while the tick is stopped.
+ *
  *===========================================================================*/
 
 #include <simplix/assert.h>
@@ -32,12 +45,28 @@
 #include <simplix/list.h>
 #include <simplix/macros.h>
 #include <simplix/proto.h>
+#include <simplix/timer.h>
 #include <simplix/types.h>
 
 /* PIT (Programmable Interrupt Timer) constants. */
 #define PIT_CHANNEL0  0x40
 #define PIT_COMMAND   0x43
 #define PIT_FREQUENCY 1193180
+#define PIT_DIVISOR   (PIT_FREQUENCY / HZ)
+
+/* PIT commands: channel 0, LSB/MSB, binary, in mode 2 (rate generator) or
+   mode 0 (interrupt on terminal count), latch of the count of channel 0, and
+   read-back of the status and count of channel 0. Bit 7 of the status is the
+   state of the output pin, which goes high once a one-shot countdown
+   completes. */
+#define PIT_CMD_PERIODIC  0x34
+#define PIT_CMD_ONESHOT   0x30
+#define PIT_CMD_LATCH     0x00
+#define PIT_CMD_READBACK  0xc2
+#define PIT_STATUS_OUTPUT 0x80
+
+/* Maximum number of ticks the PIT can count down in one-shot mode. */
+#define PIT_MAX_IDLE_TICKS (0xffff / PIT_DIVISOR)
 
 /* RTC (Real Time Clock) constants. */
 #define RTC_COMMAND 0x70
@@ -94,6 +123,11 @@ static inline unsigned int bcd_to_dec(int n)
     return res;
 }
 
+/* Number of slots in the timing wheel. This must be a power of 2. */
+#define TIMER_WHEEL_SIZE 256
+
+#define get_timer_slot(expires) ((expires) & (TIMER_WHEEL_SIZE - 1))
+
 /* Forward declarations. */
 static void handle_timer_interrupt(uint32_t esp);
 
@@ -107,19 +141,55 @@ unsigned long ticks = 0;
    or in the future. */
 time_t realtime;
 
-void init_timer(void)
+/* The timing wheel. */
+static struct timer *timer_wheel[TIMER_WHEEL_SIZE];
+
+/* Number of ticks the PIT is counting down in one-shot mode, or 0 if it is
+   in periodic mode. */
+static unsigned long stopped_ticks = 0;
+
+/*
+ * Writes the specified count to the PIT channel 0. In mode 2, a count written
+ * while the PIT is counting only takes effect at the end of the current
+ * period.
+ */
+static void set_pit_count(uint16_t count)
 {
-    /* Calculate our divisor. */
-    uint16_t divisor = PIT_FREQUENCY / HZ;
+    /* Set low byte of count. */
+    outb(PIT_CHANNEL0, count & 0xff); udelay(1);
 
-    /* Channel 0, LSB/MSB, mode 2, binary. */
-    outb(PIT_COMMAND, 0x34); udelay(1);
+    /* Set high byte of count. */
+    outb(PIT_CHANNEL0, count >> 8); udelay(1);
+}
 
-    /* Set low byte of divisor. */
-    outb(PIT_CHANNEL0, divisor & 0xff); udelay(1);
+/*
+ * Programs the PIT channel 0 with the specified command and count.
+ */
+static void program_pit(byte_t cmd, uint16_t count)
+{
+    /* Channel 0, LSB/MSB, binary, in the specified mode. */
+    outb(PIT_COMMAND, cmd); udelay(1);
 
-    /* Set high byte of divisor. */
-    outb(PIT_CHANNEL0, divisor >> 8); udelay(1);
+    set_pit_count(count);
+}
+
+/*
+ * Returns the current count of the PIT channel 0.
+ */
+static uint16_t read_pit_count(void)
+{
+    uint16_t count;
+
+    outb(PIT_COMMAND, PIT_CMD_LATCH);
+    count = inb(PIT_CHANNEL0);
+    count |= inb(PIT_CHANNEL0) << 8;
+    return count;
+}
+
+void init_timer(void)
+{
+    /* Interrupt the CPU HZ times per second. */
+    program_pit(PIT_CMD_PERIODIC, PIT_DIVISOR);
 
     /* Set the clock IRQ handler. */
     irq_set_handler(IRQ_TIMER, handle_timer_interrupt);
@@ -177,17 +247,121 @@ void init_wall_clock(void)
     realtime += hour * SECONDS_PER_HOUR;
     realtime += minute * SECONDS_PER_MINUTE;
     realtime += second;
+
+    kinfo.realtime = realtime;
 }
 
 /*
- * The system clock IRQ handler.
+ * Sets the wall clock to the specified number of seconds since the Epoch.
  */
-static void handle_timer_interrupt(uint32_t esp)
+void set_realtime(time_t t)
+{
+    unsigned long eflags;
+
+    disable_hwint(eflags);
+
+    realtime = t;
+    kinfo_update_begin();
+    kinfo.realtime = realtime;
+    kinfo_update_end();
+
+    restore_hwint(eflags);
+}
+
+/*
+ * Initializes the specified timer, which will call the specified function
+ * with the specified argument when it expires.
+ */
+void setup_timer(struct timer *timer, timer_fn_t fn, void *data)
+{
+    timer->fn = fn;
+    timer->data = data;
+    timer->prev = timer->next = NULL;
+}
+
+/*
+ * Arms the specified timer, which must not be pending, to expire at the tick
+ * specified by its expires member. A timer which should already have expired
+ * expires at the next tick.
+ */
+void add_timer(struct timer *timer)
+{
+    struct timer **slot, *t;
+    unsigned long eflags;
+
+    ASSERT(!timer->next);
+
+    disable_hwint(eflags);
+
+    if (time_before_eq(timer->expires, ticks))
+        timer->expires = ticks + 1;
+
+    /* Insert the timer before the first timer of its slot expiring after
+       it does. */
+    slot = &timer_wheel[get_timer_slot(timer->expires)];
+    t = *slot;
+    if (t) {
+        while (!time_after(t->expires, timer->expires) && t->next != *slot)
+            t = t->next;
+        if (time_after(t->expires, timer->expires)) {
+            list_insert_before(t, timer);
+            if (t == *slot)
+                *slot = timer;
+        } else {
+            list_insert_after(t, timer);
+        }
+    } else {
+        list_append(*slot, timer);
+    }
+
+    restore_hwint(eflags);
+}
+
+/*
+ * Disarms the specified timer. Returns TRUE if the timer was pending, FALSE
+ * if it already expired or was never armed.
+ */
+bool_t del_timer(struct timer *timer)
+{
+    unsigned long eflags;
+
+    disable_hwint(eflags);
+
+    if (!timer->next) {
+        restore_hwint(eflags);
+        return FALSE;
+    }
+
+    list_remove(timer_wheel[get_timer_slot(timer->expires)], timer);
+    timer->prev = timer->next = NULL;
+
+    restore_hwint(eflags);
+    return TRUE;
+}
+
+/*
+ * Runs the timers expiring at the current tick. Hardware interrupts must be
+ * disabled.
+ */
+static void run_timers(void)
+{
+    struct timer **slot, *timer;
+
+    slot = &timer_wheel[get_timer_slot(ticks)];
+
+    while (*slot && time_after_eq(ticks, (*slot)->expires)) {
+        timer = list_pop_head(*slot);
+        timer->prev = timer->next = NULL;
+        timer->fn(timer->data);
+    }
+}
+
+/*
+ * Accounts for one tick. Hardware interrupts must be disabled.
+ */
+static void do_tick(void)
 {
-    int i;
-    struct task_struct *t;
     static int realtime_ticks = HZ;
-    static int sched_ticks = SCHED_TICKS;
 
     /* Increment the global tick count. */
     ticks++;
@@ -195,24 +369,152 @@ static void handle_timer_interrupt(uint32_t esp)
     /* Update the current process CPU time. */
     current->cputime++;
 
-    /* Update the current task's time slice. */
-    if (current->pid != IDLE_TASK_PID && current->timeslice)
-        current->timeslice--;
+    /* Charge the current task for the time it ran. */
+    sched_tick();
 
     /* Do we need to update the real time? */
     if (--realtime_ticks == 0) {
         realtime_ticks = HZ;
         realtime++;
+        kinfo_update_begin();
+        kinfo.realtime = realtime;
+        kinfo_update_end();
     }
 
-    /* Check for any expired timeouts. */
-    list_for_each(task_list_head, t, i)
-        if (t->timeout) {
-            ASSERT(t->state == TASK_UNINTERRUPTIBLE);
-            t->timeout--;
-            if (!t->timeout)
-                t->state = TASK_RUNNABLE;
+    /* Run the expired timers. */
+    run_timers();
+}
+
+/*
+ * Puts the PIT back in periodic mode, and accounts for the ticks that went
+ * by while it was counting down in one-shot mode, given the number of PIT
+ * clock cycles elapsed since the last tick before the countdown started.
+ * The part of a tick that went by is not lost: the first period only lasts
+ * until the next tick is due. Hardware interrupts must be disabled.
+ */
+static void restart_tick(unsigned long clocks)
+{
+    unsigned long elapsed = clocks / PIT_DIVISOR;
+    uint16_t first = PIT_DIVISOR - clocks % PIT_DIVISOR;
+
+    stopped_ticks = 0;
+
+    /* A count of 1 is illegal in mode 2. */
+    if (first < 2)
+        first = 2;
+
+    program_pit(PIT_CMD_PERIODIC, first);
+    if (first != PIT_DIVISOR)
+        set_pit_count(PIT_DIVISOR);
+
+    while (elapsed--)
+        do_tick();
+}
+
+/*
+ * Returns the number of ticks before the next kernel timer expires, or
+ * PIT_MAX_IDLE_TICKS if no timer expires before that. Since the timers of
+ * each slot of the timing wheel are sorted, only the first timer of the
+ * next few slots needs to be looked at. Hardware interrupts must be
+ * disabled.
+ */
+static unsigned long get_idle_ticks(void)
+{
+    unsigned long n;
+    struct timer *t;
+
+    for (n = 1; n < PIT_MAX_IDLE_TICKS; n++) {
+        t = timer_wheel[get_timer_slot(ticks + n)];
+        if (t && time_before_eq(t->expires, ticks + n))
+            break;
+    }
+
+    return n;
+}
+
+/*
+ * Called at the beginning of the handling of every IRQ. If the idle task
+ * stopped the periodic tick, and the IRQ is not the one raised at the end of
+ * the one-shot countdown (which handle_timer_interrupt takes care of) finds
+ * out how many ticks went by and restarts the tick. This must be done before
+ * the IRQ handler runs, since it may wake up a task, which the IRQ path then
+ * switches to right away. Hardware interrupts must be disabled.
+ */
+void stop_idle_countdown(void)
+{
+    byte_t status;
+    uint16_t count;
+
+    if (!stopped_ticks)
+        return;
+
+    /* If the countdown just completed, the timer interrupt is pending and
+       will account for all the stopped ticks. */
+    outb(PIT_COMMAND, PIT_CMD_READBACK);
+    status = inb(PIT_CHANNEL0);
+    if (status & PIT_STATUS_OUTPUT)
+        return;
+
+    count = inb(PIT_CHANNEL0);
+    count |= inb(PIT_CHANNEL0) << 8;
+    restart_tick(stopped_ticks * PIT_DIVISOR - count);
+}
+
+/*
+ * Called by the idle task when it has nothing left to do. Halts the CPU
+ * until the next interrupt, stopping the periodic tick until the next timer
+ * expires if DYNAMIC_TICKS is set, then gives the CPU to any task that
+ * became runnable in the meantime.
+ */
+void idle_halt(void)
+{
+    unsigned long n;
+
+    cli();
+
+    if (DYNAMIC_TICKS && !has_runnable_tasks()) {
+        n = get_idle_ticks();
+        if (n > 1) {
+            /* Count down from the last tick rather than from now, so that
+               the countdown ends exactly on a tick, and the part of the
+               current tick that already went by is accounted for. */
+            stopped_ticks = n;
+            program_pit(PIT_CMD_ONESHOT,
+                n * PIT_DIVISOR - (PIT_DIVISOR - read_pit_count()));
         }
+    }
+
+    /* sti only takes effect after the next instruction, so no interrupt
+       can sneak in between the check above and hlt. */
+    if (!has_runnable_tasks())
+        asm("sti; hlt; cli");
+
+    /* The interrupt that woke us up normally restarted the tick already,
+       but hlt may also be left because of an NMI. */
+    stop_idle_countdown();
+
+    sti();
+
+    cli();
+    if (has_runnable_tasks())
+        schedule();
+    sti();
+}
+
+/*
+ * The system clock IRQ handler.
+ */
+static void handle_timer_interrupt(uint32_t esp)
+{
+    static int sched_ticks = SCHED_TICKS;
+
+    if (stopped_ticks) {
+        /* The one-shot countdown started by idle_halt completed. */
+        restart_tick(stopped_ticks * PIT_DIVISOR);
+        return;
+    }
+
+    do_tick();
 
     if (--sched_ticks == 0) {
         sched_ticks = SCHED_TICKS;
@@ -0,0 +1,212 @@
+/*===========================================================================
+ *
+ * wait.c
+ *
+ * Copyright (C) 2007 - Julien Lecomte
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ *===========================================================================
+ *
+ * Wait queues. A task waiting for some condition to become true puts itself
+ * in a wait queue, and goes to sleep. Whoever makes the condition true wakes
+ * up the wait queue. Since the condition may not hold anymore by the time a
+ * woken up task gets the CPU, or may not be the one the task is waiting for,
+ * the task checks it again, and goes back to sleep if it is false. Such
+ * wake-ups are counted as spurious in sched_stats.
+ *
+ * Waiters are either non-exclusive (all of them are woken up at once) or
+ * exclusive (only one of them is woken up at a time) The latter avoids
+ * waking up a herd of tasks when only one of them can proceed, which is
+ * the case of tasks waiting for a semaphore.
+ *
+ *===========================================================================*/
+
+#include <simplix/consts.h>
+#include <simplix/globals.h>
+#include <simplix/list.h>
+#include <simplix/macros.h>
+#include <simplix/proto.h>
+#include <simplix/stats.h>
+#include <simplix/task.h>
+#include <simplix/timer.h>
+#include <simplix/types.h>
+#include <simplix/wait.h>
+
+/*
+ * Adds the specified entry to its wait queue. Hardware interrupts must be
+ * disabled.
+ */
+static void enqueue_waiter(struct wait_queue_entry *entry)
+{
+    struct wait_queue *wq = entry->wq;
+    struct wait_queue_entry *e;
+
+    if (list_empty(wq->head)) {
+        wq->head = entry;
+        list_init(entry);
+    } else if (entry->exclusive) {
+        list_insert_before(wq->head, entry);
+    } else {
+        /* Insert the entry before the first exclusive waiter. */
+        for (e = wq->head; e->next != wq->head && !e->exclusive; e = e->next)
+            continue;
+        if (e->exclusive) {
+            list_insert_before(e, entry);
+            if (e == wq->head)
+                wq->head = entry;
+        } else {
+            list_insert_after(e, entry);
+        }
+    }
+
+    entry->queued = TRUE;
+}
+
+/*
+ * Removes the specified entry from its wait queue, and wakes up the task it
+ * belongs to. Hardware interrupts must be disabled.
+ */
+static void wake_up_waiter(struct wait_queue_entry *entry)
+{
+    list_remove(entry->wq->head, entry);
+    entry->queued = FALSE;
+    wake_up(entry->task);
+}
+
+/*
+ * Timer callback waking up a task whose wait timed out. If a wake-up already
+ * removed the entry of the task from its wait queue, the task has yet to
+ * run, and that wake-up takes precedence.
+ */
+static void handle_wait_timeout(void *data)
+{
+    struct wait_queue_entry *entry = data;
+
+    if (entry->queued) {
+        entry->timed_out = TRUE;
+        wake_up_waiter(entry);
+    } else if (!entry->wq) {
+        /* Nobody else can wake up a task waiting on no queue at all. */
+        entry->timed_out = TRUE;
+        wake_up(entry->task);
+    }
+}
+
+/*
+ * Puts the current task to sleep on the specified wait queue until the
+ * specified condition, which is called with the specified argument, is true,
+ * or until the specified number of ticks has elapsed, unless the timeout is
+ * 0. If the condition is NULL, the first wake-up ends the wait. If the wait
+ * queue is NULL, only the timeout ends the wait. Returns S_OK if the wait
+ * ended because of the condition or of a wake-up, or -E_TIMEDOUT. Do not
+ * call this function from an interrupt handler!
+ */
+ret_t wait_event(struct wait_queue *wq, wait_cond_t cond, void *data,
+    bool_t exclusive, unsigned long timeout)
+{
+    struct wait_queue_entry entry;
+    struct timer timer;
+    ret_t ret = S_OK;
+    unsigned long eflags;
+
+    disable_hwint(eflags);
+
+    if (cond && cond(data)) {
+        restore_hwint(eflags);
+        return S_OK;
+    }
+
+    entry.task = current;
+    entry.exclusive = exclusive;
+    entry.queued = FALSE;
+    entry.timed_out = FALSE;
+    entry.wq = wq;
+
+    /* The timer lives on our stack, which is fine since we make sure that
+       it is not pending anymore before we return. */
+    if (timeout) {
+        setup_timer(&timer, &handle_wait_timeout, &entry);
+        timer.expires = ticks + timeout;
+        add_timer(&timer);
+    }
+
+    sched_stats.waits++;
+
+    for (;;) {
+        if (wq)
+            enqueue_waiter(&entry);
+        sleep_on();
+
+        if (cond ? cond(data) : !entry.timed_out)
+            break;
+
+        /* The timeout may also have expired after a wake-up dequeued us, in
+           which case we give up too. If that wake-up was meant for a single
+           exclusive waiter, pass it on to the next one. */
+        if (entry.timed_out || (timeout && !timer_pending(&timer))) {
+            if (exclusive && !entry.timed_out)
+                wait_queue_wake(wq);
+            ret = -E_TIMEDOUT;
+            break;
+        }
+
+        /* We were woken up for nothing. Go back to sleep. */
+        sched_stats.spurious_wakeups++;
+    }
+
+    if (timeout)
+        del_timer(&timer);
+
+    restore_hwint(eflags);
+    return ret;
+}
+
+/*
+ * Wakes up all the non-exclusive waiters of the specified wait queue, and
+ * the first exclusive waiter, if any. This may be called from an interrupt
+ * handler.
+ */
+void wait_queue_wake(struct wait_queue *wq)
+{
+    bool_t exclusive;
+    unsigned long eflags;
+
+    disable_hwint(eflags);
+
+    while (!list_empty(wq->head)) {
+        exclusive = wq->head->exclusive;
+        wake_up_waiter(wq->head);
+        if (exclusive)
+            break;
+    }
+
+    restore_hwint(eflags);
+}
+
+/*
+ * Wakes up all the waiters of the specified wait queue.
+ */
+void wait_queue_wake_all(struct wait_queue *wq)
+{
+    unsigned long eflags;
+
+    disable_hwint(eflags);
+
+    while (!list_empty(wq->head))
+        wake_up_waiter(wq->head);
+
+    restore_hwint(eflags);
+}
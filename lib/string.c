@@ -48,6 +48,20 @@ void *memcpy(void *dest, const void *src, size_t n)
     return dest;
 }
 
+void *memmove(void *dest, const void *src, size_t n)
+{
+    char *s = (char *) src;
+    char *d = (char *) dest;
+    if (d <= s)
+        return memcpy(dest, src, n);
+    /* The areas may overlap. Copy backwards. */
+    s += n;
+    d += n;
+    while (n-- > 0)
+        *--d = *--s;
+    return dest;
+}
+
 int vsnprintf(char *str, size_t size, const char *format, va_list ap)
 {
     char c;
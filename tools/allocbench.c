@@ -0,0 +1,880 @@
+/*===========================================================================
+ *
+ * allocbench.c
+ *
+ * Copyright (C) 2007 - Julien Lecomte
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ *===========================================================================
+ *
+ * Benchmark and consistency checker for the kernel memory allocators. This
+ * is a regular Linux program, linked with kernel/physmem.c, kernel/kmem.c
+ * and lib/string.c, which are built with HOSTED defined (see macros.h and
+ * the allocbench target in the Makefile) The "physical memory" managed by
+ * the allocators is a large arena mapped at a low address, so that kernel
+ * addresses (which are 32 bits wide) can be used as regular pointers.
+ *
+ * The allocators are driven by a trace of operations, either generated on
+ * the fly (fork-like, slab churn or ramdisk patterns) or read from a file.
+ * A trace file contains one operation per line:
+ *
+ *     a <id> <pages>    Allocate a block of physical memory.
+ *     z <id> <pages>    Allocate a block of zeroed physical memory.
+ *     m <id> <pages>    Same as 'a', and declare the block as movable.
+ *     M <id> <pages>    Same as 'z', and declare the block as movable.
+ *     r <id> <pages>    Reallocate a block of physical memory.
+ *     f <id>            Free a block of physical memory.
+ *     k <id> <bytes>    Allocate an object using kmalloc.
+ *     K <id>            Free an object using kfree.
+ *
+ * Lines starting with '#' are ignored. Every block and object is filled with
+ * a pattern that gets verified when it is freed, and the pages owned by each
+ * block are tracked, so that overlapping allocations are caught. The program
+ * exits with a non zero status if any inconsistency is found.
+ *
+ * With -b, a microbenchmark measuring the cost of __kmalloc and kfree for
+ * object sizes ranging from 8 bytes to 64 KB is run instead.
+ *
+ *===========================================================================*/
+
+#define _GNU_SOURCE
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/simplix/stats.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+/*===========================================================================*
+ * Kernel interface.                                                         *
+ *===========================================================================*/
+
+/* These must match the kernel types (see types.h) Kernel sizes and
+   addresses are 32 bits wide, and bool_t is an enum. */
+typedef uint32_t kaddr_t;
+typedef uint32_t ksize_t;
+typedef uint8_t kret_t;
+typedef int kbool_t;
+typedef kbool_t (* kmover_t)(void *owner, kaddr_t new_addr);
+
+/* These must match the prototypes in proto.h */
+void init_physmem(ksize_t memsize);
+void init_kmem(void);
+kret_t alloc_physmem_block(ksize_t pages, kaddr_t *paddr);
+kret_t __alloc_physmem_block(ksize_t pages, kaddr_t *paddr);
+kret_t free_physmem_block(kaddr_t addr);
+kret_t realloc_physmem_block(kaddr_t addr, ksize_t pages, kaddr_t *paddr);
+kret_t set_physmem_block_mover(kaddr_t addr, kmover_t mover, void *owner);
+ksize_t get_physmem_largest_hole(void);
+void *kmalloc(ksize_t size);
+void *__kmalloc(ksize_t size);
+void kfree(void *ptr);
+unsigned int get_kmalloc_stats(struct kmem_slab_stats *stats, unsigned int n);
+
+extern struct physmem_stats physmem_stats;
+
+#define S_OK 0
+#define PAGE_BIT_SHIFT 12
+#define PAGE_SIZE (1 << PAGE_BIT_SHIFT)
+
+/* The arena starts at the lowest address Linux usually lets us map. The
+   kernel considers everything below __e_kernel (see the Makefile) as used. */
+#define ARENA_START 0x10000
+
+/* Largest object served by the slabs used by kmalloc, and number of kmalloc
+   size classes: one per slab, and one per page pool, plus one for the objects
+   too large for the page pools (see kmem.c) */
+#define KMEM_SLAB_MAX_SIZE 1024
+#define NR_KMALLOC_CLASSES (128 + 5 + 1)
+
+/* Number of objects the microbenchmark allocates before freeing them. */
+#define BENCH_BATCH 32
+
+/* The following kernel functions are used by the allocators. */
+
+void panic(const char *format, ...)
+{
+    va_list ap;
+
+    va_start(ap, format);
+    fprintf(stderr, "KERNEL PANIC: ");
+    vfprintf(stderr, format, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    exit(2);
+}
+
+int printk(const char *format, ...)
+{
+    return 0;
+}
+
+void do_sleep(unsigned long msec)
+{
+}
+
+
+/*===========================================================================*
+ * Traces.                                                                   *
+ *===========================================================================*/
+
+struct op {
+    char type;
+    uint32_t id;
+    uint32_t arg;
+};
+
+static struct op *trace = NULL;
+static size_t trace_len = 0, trace_cap = 0;
+
+/* Maximum number of simultaneously live objects in a trace. */
+#define MAX_OBJECTS 65536
+
+static void emit(char type, uint32_t id, uint32_t arg)
+{
+    if (trace_len == trace_cap) {
+        trace_cap = trace_cap ? trace_cap * 2 : 4096;
+        trace = realloc(trace, trace_cap * sizeof(struct op));
+        if (!trace) {
+            perror("realloc");
+            exit(2);
+        }
+    }
+
+    trace[trace_len].type = type;
+    trace[trace_len].id = id;
+    trace[trace_len].arg = arg;
+    trace_len++;
+}
+
+static int read_trace(const char *path)
+{
+    FILE *f;
+    char line[256], type;
+    unsigned int id, arg;
+    int n;
+
+    f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        arg = 0;
+        n = sscanf(line, " %c %u %u", &type, &id, &arg);
+        if (n < 2 || !strchr("azmMrfkK", type) || id >= MAX_OBJECTS) {
+            fprintf(stderr, "%s: invalid line: %s", path, line);
+            fclose(f);
+            return -1;
+        }
+        emit(type, id, arg);
+    }
+
+    fclose(f);
+    return 0;
+}
+
+static int write_trace(const char *path)
+{
+    FILE *f;
+    size_t i;
+
+    f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    fprintf(f, "# Simplix allocator trace (see tools/allocbench.c)\n");
+    for (i = 0; i < trace_len; i++) {
+        if (trace[i].type == 'f' || trace[i].type == 'K')
+            fprintf(f, "%c %u\n", trace[i].type, trace[i].id);
+        else
+            fprintf(f, "%c %u %u\n", trace[i].type, trace[i].id, trace[i].arg);
+    }
+
+    fclose(f);
+    return 0;
+}
+
+
+/*===========================================================================*
+ * Trace generators.                                                         *
+ *===========================================================================*/
+
+static uint32_t rnd_state = 1;
+
+static uint32_t rnd(void)
+{
+    /* xorshift32 */
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state;
+}
+
+/* Generated object identifiers are recycled. */
+static uint32_t free_ids[MAX_OBJECTS];
+static uint32_t nr_free_ids = 0, next_id = 0;
+
+static uint32_t get_id(void)
+{
+    if (nr_free_ids)
+        return free_ids[--nr_free_ids];
+    if (next_id == MAX_OBJECTS) {
+        fprintf(stderr, "Too many live objects\n");
+        exit(2);
+    }
+    return next_id++;
+}
+
+static void put_id(uint32_t id)
+{
+    free_ids[nr_free_ids++] = id;
+}
+
+/* A simulated process: a task descriptor, a kernel stack, and a segment. */
+struct process {
+    uint32_t task, kstack, seg;
+    uint32_t seg_pages;
+};
+
+#define MAX_PROCESSES 64
+
+static struct process procs[MAX_PROCESSES];
+static unsigned int nr_procs = 0;
+
+/*
+ * One step of the fork-like pattern: processes get forked, grow their data
+ * segment with brk, and exit.
+ */
+static void fork_step(void)
+{
+    struct process *p;
+    unsigned int i;
+
+    if (nr_procs < 4 || (nr_procs < MAX_PROCESSES && rnd() % 3 == 0)) {
+        p = &procs[nr_procs++];
+        p->task = get_id();
+        p->kstack = get_id();
+        p->seg = get_id();
+        p->seg_pages = rnd() % 16 ? 4 + rnd() % 60 : 128 + rnd() % 384;
+        emit('k', p->task, 128);
+        emit('z', p->kstack, 1);
+        emit('m', p->seg, p->seg_pages);
+    } else if (rnd() % 4 == 0) {
+        p = &procs[rnd() % nr_procs];
+        p->seg_pages += 1 + rnd() % 8;
+        emit('r', p->seg, p->seg_pages);
+    } else {
+        i = rnd() % nr_procs;
+        p = &procs[i];
+        emit('f', p->seg, 0);
+        emit('f', p->kstack, 0);
+        emit('K', p->task, 0);
+        put_id(p->seg);
+        put_id(p->kstack);
+        put_id(p->task);
+        procs[i] = procs[--nr_procs];
+    }
+}
+
+static void gen_fork(size_t nops)
+{
+    while (trace_len < nops)
+        fork_step();
+}
+
+/*
+ * Slab churn: lots of small kmalloc/kfree, biased toward small sizes.
+ */
+static void gen_slab(size_t nops)
+{
+    static uint32_t live[MAX_OBJECTS / 2];
+    unsigned int nr_live = 0, i, size, r;
+
+    while (trace_len < nops) {
+        if (nr_live < 256 || (nr_live < MAX_OBJECTS / 2 && rnd() % 100 < 55)) {
+            r = rnd() % 100;
+            if (r < 70)
+                size = 8 + rnd() % 121;
+            else if (r < 95)
+                size = 129 + rnd() % 384;
+            else
+                size = 513 + rnd() % (KMEM_SLAB_MAX_SIZE - 513);
+            live[nr_live] = get_id();
+            emit('k', live[nr_live++], size);
+        } else {
+            i = rnd() % nr_live;
+            emit('K', live[i], 0);
+            put_id(live[i]);
+            live[i] = live[--nr_live];
+        }
+    }
+}
+
+/*
+ * Ramdisks: large, long lived, movable blocks on top of the fork pattern.
+ */
+static void gen_ramdisk(size_t nops)
+{
+    uint32_t disks[4];
+    unsigned int nr_disks = 0, i;
+
+    while (trace_len < nops) {
+        if (rnd() % 200) {
+            fork_step();
+        } else if (nr_disks < 4 && rnd() % 2) {
+            disks[nr_disks] = get_id();
+            emit('M', disks[nr_disks++], 256 + rnd() % 1792);
+        } else if (nr_disks) {
+            i = rnd() % nr_disks;
+            emit('f', disks[i], 0);
+            put_id(disks[i]);
+            disks[i] = disks[--nr_disks];
+        }
+    }
+}
+
+
+/*===========================================================================*
+ * Trace execution and consistency checks.                                   *
+ *===========================================================================*/
+
+struct object {
+    kaddr_t addr;
+    uint32_t size;
+    char type;
+};
+
+static struct object objects[MAX_OBJECTS];
+
+/* Id + 1 of the block owning each page, or 0. */
+static uint32_t *page_owner;
+
+static unsigned long errors = 0;
+
+static void error(const char *format, ...)
+{
+    va_list ap;
+
+    if (errors++ < 10) {
+        va_start(ap, format);
+        fprintf(stderr, "ERROR: ");
+        vfprintf(stderr, format, ap);
+        fprintf(stderr, "\n");
+        va_end(ap);
+    }
+}
+
+static uint32_t tag(uint32_t id, uint32_t n)
+{
+    return (id * 2654435761u) ^ n;
+}
+
+static void own_pages(uint32_t id, kaddr_t addr, uint32_t pages)
+{
+    uint32_t i, pfn = addr >> PAGE_BIT_SHIFT;
+
+    for (i = 0; i < pages; i++) {
+        if (page_owner[pfn + i])
+            error("block %u overlaps block %u at page %u", id,
+                page_owner[pfn + i] - 1, pfn + i);
+        page_owner[pfn + i] = id + 1;
+    }
+}
+
+static void release_pages(kaddr_t addr, uint32_t pages)
+{
+    memset(&page_owner[addr >> PAGE_BIT_SHIFT], 0, pages * sizeof(uint32_t));
+}
+
+/* The first word of each page of a block is tagged. */
+
+static void fill_pages(uint32_t id, kaddr_t addr, uint32_t first, uint32_t pages)
+{
+    uint32_t i;
+
+    for (i = first; i < pages; i++)
+        *(uint32_t *) (uintptr_t) (addr + (i << PAGE_BIT_SHIFT)) = tag(id, i);
+}
+
+static void check_pages(uint32_t id, kaddr_t addr, uint32_t pages)
+{
+    uint32_t i;
+
+    for (i = 0; i < pages; i++)
+        if (*(uint32_t *) (uintptr_t) (addr + (i << PAGE_BIT_SHIFT)) != tag(id, i)) {
+            error("block %u was corrupted (page %u of %u)", id, i, pages);
+            return;
+        }
+}
+
+static void check_zero(uint32_t id, kaddr_t addr, size_t len)
+{
+    const uint64_t *p = (const uint64_t *) (uintptr_t) addr;
+    size_t i;
+
+    for (i = 0; i < len / sizeof(uint64_t); i++)
+        if (p[i]) {
+            error("block %u is not filled with zeros", id);
+            return;
+        }
+}
+
+/*
+ * Mover of the blocks declared movable. The content is copied by physmem.c
+ * once we return.
+ */
+static kbool_t mover(void *owner, kaddr_t new_addr)
+{
+    uint32_t id = (uint32_t) (uintptr_t) owner;
+    struct object *o = &objects[id];
+
+    release_pages(o->addr, o->size);
+    own_pages(id, new_addr, o->size);
+    o->addr = new_addr;
+    return 1;
+}
+
+/* Latencies, in nanoseconds, per type of operation. */
+
+#define NR_OP_TYPES 8
+
+static const char op_types[NR_OP_TYPES + 1] = "azmMrfkK";
+
+static const char *op_names[NR_OP_TYPES] = {
+    "alloc", "zalloc", "alloc-mv", "zalloc-mv", "realloc", "free", "kmalloc", "kfree"
+};
+
+static uint32_t *latencies[NR_OP_TYPES];
+static size_t nr_latencies[NR_OP_TYPES];
+static unsigned long failures[NR_OP_TYPES];
+
+static inline uint64_t now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Runs the specified operation. Returns the time spent in the allocator.
+ */
+static uint64_t run_op(const struct op *op, int *failed)
+{
+    struct object *o = &objects[op->id];
+    uint64_t t0, t1;
+    kaddr_t addr;
+    kret_t res;
+    void *ptr;
+    uint32_t old;
+
+    *failed = 0;
+
+    switch (op->type) {
+
+        case 'a':
+        case 'z':
+        case 'm':
+        case 'M':
+            if (o->type || !op->arg)
+                return 0;
+            t0 = now();
+            if (op->type == 'a' || op->type == 'm')
+                res = __alloc_physmem_block(op->arg, &addr);
+            else
+                res = alloc_physmem_block(op->arg, &addr);
+            t1 = now();
+            if (res != S_OK) {
+                *failed = 1;
+                return t1 - t0;
+            }
+            own_pages(op->id, addr, op->arg);
+            if (op->type == 'z' || op->type == 'M')
+                check_zero(op->id, addr, op->arg << PAGE_BIT_SHIFT);
+            fill_pages(op->id, addr, 0, op->arg);
+            o->type = 'p';
+            o->addr = addr;
+            o->size = op->arg;
+            if (op->type == 'm' || op->type == 'M')
+                set_physmem_block_mover(addr, &mover, (void *) (uintptr_t) op->id);
+            return t1 - t0;
+
+        case 'r':
+            if (o->type != 'p' || !op->arg)
+                return 0;
+            old = o->size;
+            release_pages(o->addr, old);
+            t0 = now();
+            res = realloc_physmem_block(o->addr, op->arg, &addr);
+            t1 = now();
+            if (res != S_OK) {
+                own_pages(op->id, o->addr, old);
+                *failed = 1;
+                return t1 - t0;
+            }
+            own_pages(op->id, addr, op->arg);
+            o->addr = addr;
+            o->size = op->arg;
+            if (op->arg > old) {
+                check_pages(op->id, addr, old);
+                check_zero(op->id, addr + (old << PAGE_BIT_SHIFT),
+                    (op->arg - old) << PAGE_BIT_SHIFT);
+                fill_pages(op->id, addr, old, op->arg);
+            } else {
+                check_pages(op->id, addr, op->arg);
+            }
+            return t1 - t0;
+
+        case 'f':
+            if (o->type != 'p')
+                return 0;
+            check_pages(op->id, o->addr, o->size);
+            release_pages(o->addr, o->size);
+            t0 = now();
+            res = free_physmem_block(o->addr);
+            t1 = now();
+            if (res != S_OK)
+                error("could not free block %u", op->id);
+            o->type = 0;
+            return t1 - t0;
+
+        case 'k':
+            if (o->type || !op->arg)
+                return 0;
+            t0 = now();
+            ptr = kmalloc(op->arg);
+            t1 = now();
+            if (!ptr) {
+                *failed = 1;
+                return t1 - t0;
+            }
+            check_zero(op->id, (kaddr_t) (uintptr_t) ptr, op->arg);
+            memset(ptr, tag(op->id, 0), op->arg);
+            o->type = 'k';
+            o->addr = (kaddr_t) (uintptr_t) ptr;
+            o->size = op->arg;
+            return t1 - t0;
+
+        case 'K':
+            if (o->type != 'k')
+                return 0;
+            ptr = (void *) (uintptr_t) o->addr;
+            for (old = 0; old < o->size; old++)
+                if (((uint8_t *) ptr)[old] != (uint8_t) tag(op->id, 0)) {
+                    error("object %u was corrupted (byte %u of %u)", op->id, old, o->size);
+                    break;
+                }
+            t0 = now();
+            kfree(ptr);
+            t1 = now();
+            o->type = 0;
+            return t1 - t0;
+    }
+
+    return 0;
+}
+
+/*
+ * Prints the number of objects in the first cache of each kmalloc size
+ * class, and the size of that cache. This must be done before any other use
+ * of kmalloc.
+ */
+static void report_kmem_density(void)
+{
+    static struct kmem_slab_stats stats[NR_KMALLOC_CLASSES];
+    unsigned int size;
+    void *ptr;
+
+    printf("allocbench: objects per kmem cache (and cache size in KB), by size class\n");
+
+    for (size = 8; size <= KMEM_SLAB_MAX_SIZE; size += 8) {
+        ptr = kmalloc(size);
+        if (!ptr) {
+            error("kmalloc failed");
+            return;
+        }
+        get_kmalloc_stats(stats, NR_KMALLOC_CLASSES);
+        kfree(ptr);
+        printf("  %4u:%5lu (%2lu)%s", size, stats[size / 8 - 1].total_objects,
+            stats[size / 8 - 1].pages << (PAGE_BIT_SHIFT - 10),
+            size % 48 ? "" : "\n");
+    }
+    printf("\n");
+}
+
+/*
+ * Prints how well the memory used by the kmalloc size classes is utilized.
+ */
+static void report_kmem_utilization(int verbose)
+{
+    static struct kmem_slab_stats stats[NR_KMALLOC_CLASSES];
+    unsigned long used = 0, pages = 0;
+    unsigned int i;
+
+    get_kmalloc_stats(stats, NR_KMALLOC_CLASSES);
+
+    if (verbose)
+        printf("\n  %-6s %7s %7s %7s %9s %9s %6s\n", "class", "order",
+            "caches", "pages", "objects", "slots", "used");
+
+    for (i = 0; i < NR_KMALLOC_CLASSES; i++) {
+        used += stats[i].active_objects * stats[i].object_size;
+        pages += stats[i].pages;
+        if (verbose && stats[i].pages && stats[i].object_size)
+            printf("  %-6lu %7lu %7lu %7lu %9lu %9lu %5.1f%%\n",
+                stats[i].object_size, stats[i].cache_order, stats[i].caches,
+                stats[i].pages, stats[i].active_objects, stats[i].total_objects,
+                100.0 * stats[i].active_objects * stats[i].object_size /
+                (stats[i].pages << PAGE_BIT_SHIFT));
+    }
+
+    printf("  kmalloc caches at the end: %lu pages, %.1f%% used by objects\n",
+        pages, pages ? 100.0 * used / (pages << PAGE_BIT_SHIFT) : 0);
+}
+
+/*
+ * Allocates and frees batches of objects of increasing sizes, and prints the
+ * average time spent in __kmalloc and kfree for each size.
+ */
+static void run_kmalloc_bench(size_t nops)
+{
+    static struct kmem_slab_stats stats[NR_KMALLOC_CLASSES];
+    void *ptrs[BENCH_BATCH];
+    unsigned long pages, fails, rounds, r;
+    uint64_t t0, t1, t2, talloc, tfree;
+    unsigned int size, i, j, k;
+    static const unsigned int sizes[] = {
+        8, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024,
+        1536, 2048, 3072, 4096, 6144, 8192, 12288, 16384, 24576, 32768,
+        49152, 65536
+    };
+
+    rounds = nops / (2 * BENCH_BATCH) ? nops / (2 * BENCH_BATCH) : 1;
+
+    printf("allocbench: __kmalloc/kfree microbenchmark, %lu rounds of %u objects\n",
+        rounds, BENCH_BATCH);
+    printf("\n  %-8s %12s %12s %7s %7s\n",
+        "size", "alloc (ns)", "free (ns)", "failed", "pages");
+
+    for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+        size = sizes[k];
+        talloc = tfree = 0;
+        fails = 0;
+        for (r = 0; r < rounds; r++) {
+            t0 = now();
+            for (j = 0; j < BENCH_BATCH; j++)
+                ptrs[j] = __kmalloc(size);
+            t1 = now();
+            for (j = 0; j < BENCH_BATCH; j++)
+                if (ptrs[j])
+                    kfree(ptrs[j]);
+                else
+                    fails++;
+            t2 = now();
+            talloc += t1 - t0;
+            tfree += t2 - t1;
+        }
+
+        get_kmalloc_stats(stats, NR_KMALLOC_CLASSES);
+        for (i = 0, pages = 0; i < NR_KMALLOC_CLASSES; i++)
+            pages += stats[i].pages;
+
+        printf("  %-8u %12.1f %12.1f %7lu %7lu\n", size,
+            (double) talloc / (rounds * BENCH_BATCH),
+            (double) tfree / (rounds * BENCH_BATCH), fails, pages);
+    }
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(uint32_t *v, size_t n, unsigned int p)
+{
+    return n ? v[(n - 1) * p / 100] : 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "Usage: %s [-t fork|slab|ramdisk] [-r trace] [-w trace]\n"
+        "          [-n ops] [-m megabytes] [-s seed] [-c] [-u] [-b]\n"
+        "\n"
+        "  -t  Generate a trace using the specified pattern (default: fork)\n"
+        "  -r  Replay the specified trace file instead\n"
+        "  -w  Record the trace to the specified file before running it\n"
+        "  -n  Number of operations to generate (default: 200000)\n"
+        "  -m  Amount of physical memory, in megabytes (default: 64)\n"
+        "  -s  Seed of the trace generator (default: 1)\n"
+        "  -c  Report the number of objects per kmem cache instead\n"
+        "  -u  Report the utilization of each kmalloc size class\n"
+        "  -b  Run a kmalloc microbenchmark, from 8 B to 64 KB, instead\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *pattern = "fork", *replay = NULL, *record = NULL;
+    size_t nops = 200000, i, k;
+    unsigned long memsize = 64, initial_free, used, peak = 0;
+    unsigned long samples = 0, largest;
+    double frag, frag_sum = 0, frag_max = 0, elapsed;
+    uint64_t total = 0, t;
+    int c, failed, density = 0, utilization = 0, bench = 0;
+    void *arena;
+
+    while ((c = getopt(argc, argv, "t:r:w:n:m:s:cub")) != -1) {
+        switch (c) {
+            case 't': pattern = optarg; break;
+            case 'r': replay = optarg; break;
+            case 'w': record = optarg; break;
+            case 'n': nops = strtoul(optarg, NULL, 0); break;
+            case 'm': memsize = strtoul(optarg, NULL, 0); break;
+            case 's': rnd_state = strtoul(optarg, NULL, 0) | 1; break;
+            case 'c': density = 1; break;
+            case 'u': utilization = 1; break;
+            case 'b': bench = 1; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (!memsize || memsize > 512)
+        usage(argv[0]);
+    memsize <<= 20;
+
+    /* Get the trace. */
+    if (replay) {
+        if (read_trace(replay))
+            return 2;
+        pattern = replay;
+    } else if (!strcmp(pattern, "fork")) {
+        gen_fork(nops);
+    } else if (!strcmp(pattern, "slab")) {
+        gen_slab(nops);
+    } else if (!strcmp(pattern, "ramdisk")) {
+        gen_ramdisk(nops);
+    } else {
+        usage(argv[0]);
+    }
+
+    if (record && write_trace(record))
+        return 2;
+
+    /* Map the physical memory and initialize the allocators. */
+    arena = mmap((void *) ARENA_START, memsize - ARENA_START,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if (arena != (void *) ARENA_START) {
+        perror("mmap");
+        return 2;
+    }
+
+    page_owner = calloc(memsize >> PAGE_BIT_SHIFT, sizeof(uint32_t));
+    for (k = 0; k < NR_OP_TYPES; k++)
+        latencies[k] = malloc(trace_len * sizeof(uint32_t));
+    if (!page_owner || !latencies[NR_OP_TYPES - 1]) {
+        perror("malloc");
+        return 2;
+    }
+
+    init_physmem(memsize);
+    init_kmem();
+    initial_free = physmem_stats.free_pages;
+
+    if (density) {
+        report_kmem_density();
+        return errors ? 1 : 0;
+    }
+
+    if (bench) {
+        run_kmalloc_bench(nops);
+        return errors ? 1 : 0;
+    }
+
+    /* Run the trace. */
+    for (i = 0; i < trace_len; i++) {
+
+        t = run_op(&trace[i], &failed);
+        total += t;
+        k = strchr(op_types, trace[i].type) - op_types;
+        latencies[k][nr_latencies[k]++] = t;
+        failures[k] += failed;
+
+        used = initial_free - physmem_stats.free_pages;
+        if (used > peak)
+            peak = used;
+
+        if (i % 1000 == 999) {
+            largest = get_physmem_largest_hole();
+            frag = physmem_stats.free_pages ?
+                1.0 - (double) largest / physmem_stats.free_pages : 0;
+            frag_sum += frag;
+            if (frag > frag_max)
+                frag_max = frag;
+            samples++;
+        }
+    }
+
+    /* Report. */
+    elapsed = total / 1e9;
+    printf("allocbench: trace %s, %zu operations, %lu MB of memory\n",
+        pattern, trace_len, memsize >> 20);
+    printf("\n  %-10s %9s %7s %9s %9s %9s %9s\n",
+        "operation", "count", "failed", "p50 (ns)", "p90 (ns)", "p99 (ns)", "max (ns)");
+    for (k = 0; k < NR_OP_TYPES; k++) {
+        if (!nr_latencies[k])
+            continue;
+        qsort(latencies[k], nr_latencies[k], sizeof(uint32_t), compare_u32);
+        printf("  %-10s %9zu %7lu %9u %9u %9u %9u\n", op_names[k],
+            nr_latencies[k], failures[k],
+            percentile(latencies[k], nr_latencies[k], 50),
+            percentile(latencies[k], nr_latencies[k], 90),
+            percentile(latencies[k], nr_latencies[k], 99),
+            latencies[k][nr_latencies[k] - 1]);
+    }
+    printf("\n  time spent in the allocators: %.3f s (%.0f ops/sec)\n",
+        elapsed, elapsed > 0 ? trace_len / elapsed : 0);
+    printf("  peak footprint: %lu pages (%lu KB)\n", peak, peak << (PAGE_BIT_SHIFT - 10));
+    printf("  fragmentation (1 - largest hole / free memory): average %.1f%%, worst %.1f%%\n",
+        samples ? 100 * frag_sum / samples : 0, 100 * frag_max);
+    printf("  zeroed allocations: %lu, served from clean pages: %lu\n",
+        physmem_stats.zeroed_allocs, physmem_stats.clean_hits);
+    printf("  compactions: %lu, bytes moved: %lu\n",
+        physmem_stats.compaction_runs, physmem_stats.compaction_moved_bytes);
+    printf("  shrinker runs: %lu, pages released: %lu\n",
+        physmem_stats.shrinker_runs, physmem_stats.shrunk_pages);
+    report_kmem_utilization(utilization);
+    printf("  consistency errors: %lu\n", errors);
+
+    return errors ? 1 : 0;
+}